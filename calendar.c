@@ -8,28 +8,145 @@
  *
  *   Running program without arguments will print current month
  *
+ *   Date queries (on the given date(s), or on every line of stdin):
+ *     dow <date>     Weekday of a date (2024-03-05), e.g. Tue
+ *     doy <date>     Day of year (1-366)
+ *     week <date>    ISO week, e.g. 2024-W10
+ *     diff <date> <date> Days from the first date to the second
+ *     add <date> <n> <unit> Date n (+3, -1...) days, weeks, months or years later
+ *     stats <date> <date> Days of each weekday, months starting on each weekday,
+ *                    leap days and months with five weekends in a range
+ *                      Note: Not read from stdin
+ *
+ *   Timestamp conversion:
+ *     epoch [<offset>] Replace the Unix timestamp starting each line of stdin
+ *                    with its date, time, weekday and ISO week
+ *                      Note: offset is a UTC offset (+01:00), utc (default)
+ *                            or local
+ *     annotate <file> [weekday | week | fiscal <periods> <end>]
+ *                    Prefix every line of a log file with the weekday, ISO
+ *                    week (default) or fiscal period of the date or Unix
+ *                    timestamp it starts with
+ *
  *   Options:
  *     -y <num>       Year to print
  *                      Note: Prints whole year if -m is not specified
  *     -m <num>       Month to print
  *                      Note: January = 0 
  *     -w             Print week numbers
+ *     -j             Print day of year numbers (1-366) instead of day numbers
  *     -n <num>       Number of months to print
- *                      Note: Will only print until end of year
+ *                      Note: Continues into the following years
  *                            Starts from current month if -m is not specified
  *                            Prints whole year if used with -y without -m
+ *     --from <y-m>   First month of a continuous range, e.g. 2023-11
+ *                      Note: January = 1 (ISO style)
+ *     --to <y-m>     Last month of a continuous range, e.g. 2025-02
+ *                      Note: Starts from current month if --from is not specified
+ *     -c <num>       Number of consecutive years to print, starting at -y
+ *                      Note: Rendered in parallel and streamed with constant memory
+ *     -d             Used with -c: write a deduplicated archive where each
+ *                    distinct year body is stored once
+ *     -z             Used with -c: compress the output (fast LZ codec)
+ *     -r <file>      Print the plain calendars stored in an exported file
+ *                      Note: Reads compressed and deduplicated exports
+ *     -o <file>      Write output to file instead of stdout
+ *     --busy <file>  Event file of one person, may be repeated
+ *                      Note: Prints the number of busy people on each day
+ *                            instead of day numbers ("." if nobody is busy)
+ *     --slots <minutes> <num>
+ *                    Used with --busy: find the first <num> free slots of
+ *                    <minutes> shared by everyone, highlight and list them
+ *                      Note: Searches working hours on Monday to Friday from the
+ *                            first printed month (from now without -y or --from)
+ *     --hours <h-h>  Working hours for --slots, default 09:00-17:00
+ *                      Note: Also limits the hours shown by --week
+ *     --week <date>  Print the week containing <date> (2024-03-05 or "now")
+ *                    with one row per hour and the --events and --rules
+ *                    events placed into it
+ *                      Note: -n prints that many weeks
+ *     --events <file> Event file (calendar), may be repeated
+ *                      Note: Files named *.csv use commas between fields
+ *                            Days with events are highlighted
+ *     --store <file> Event store, used like --events. Only the events of the
+ *                    printed time are read
+ *     --store-add <file> Append the events on stdin to a store
+ *                      Note: Compacts the store when its log has grown large
+ *     --compact <file> Merge the log of a store into its index
+ *     --fiscal <periods> <end>
+ *                    Fiscal calendar of 52/53 week years: periods is 4-4-5,
+ *                    4-5-4 or 5-4-4, end is when the year ends, e.g.
+ *                    last-sat-jan or nearest-sat-jan (nearest to January 31)
+ *                      Note: -w shows fiscal weeks, period starts are
+ *                            highlighted and the periods are listed
+ *     --theme <name> Colors: default, none, 256 (256 color terminals) or
+ *                    truecolor (24 bit). The 256 and truecolor themes also
+ *                    dim weekends
+ *     --select <date>..<date> Underline a range of days, e.g.
+ *                    2024-03-04..2024-03-15
+ *     --ics          Write the events, rule occurrences, holidays and cron fire
+ *                    times of the printed months as iCalendar instead
+ *     --grep <words> Highlight the days with events holding all of the words,
+ *                    instead of all days with events
+ *     --watch Keep printing the months, updated whenever an --events or
+ *             --store file changes
+ *     --holidays <file> Highlight the days of a holiday list or compiled day file
+ *                      Note: Lists hold a day (2024-12-25) or range of days
+ *                            (2024-07-15..2024-08-09) per line
+ *     --compile-days <list> <file> Compile a holiday list into a day file
+ *     --rules <file> Recurrence rule file, may be repeated
+ *     --agenda <num> List the next <num> events of all --events and --rules
+ *                    files instead of printing a calendar
+ *                      Note: Starts from the first printed month (from now
+ *                            without -y or --from)
+ *     --conflicts    Highlight days with overlapping events of the --events
+ *                    calendars and list the overlaps
+ *     --cron <expr>  Cron expression ("0 9 * * 1-5"), may be repeated.
+ *                    Highlights the days it fires on and lists its next fire times
+ *                      Note: Listed from the first printed month (from now
+ *                            without -y or --from)
+ *     --crontab <file> Same as --cron for every job of a crontab file
+ *     --fires <num>  Number of fire times listed per cron expression, default 5
  *     -h             Display this help page
  */
 
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 const char *month_name[12] = {"January", "February", "March", "April", "May", "June", "July", "August", "September", "October", "November", "December"};
 const char *day_names = "Su Mo Tu We Th Fr Sa";
-int num_days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+const char *weekday_abbr[7] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+const char *julian_day_names = " Su  Mo  Tu  We  Th  Fr  Sa";
+/* Number of days in each month, indexed by [leap][month] */
+const int num_days[2][12] = {
+    {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31},
+    {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31}
+};
+
+/* Days passed before the start of each month, indexed by [leap][month].
+ * Kept constant so the date core has no runtime state to build up or refill
+ * and gives the same answer regardless of what was printed before.
+ */
+const int days_before_month[2][13] = {
+    {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365},
+    {0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335, 366}
+};
 
 
  /* COLOR CODES
@@ -43,9 +160,118 @@ int num_days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
  */
 #define RST "\033[0m"
 
+/*
+ * Colors for marked days (meeting slots, search results...)
+ */
+#define MRKB "\033[30m\033[42m"
+
+/*
+ * Colors for holidays
+ */
+#define HOLB "\033[30m\033[41m"
+
+/* STYLES
+ *
+ * Every day cell gets one style, the first that applies of today, marked
+ * day, holiday, selected range (--select) and weekend. A theme gives the
+ * escape sequence of each style; "" leaves the cell plain, so the default
+ * theme only colors today, marks and holidays. The default theme resets
+ * after every cell, as always, so its output is unchanged. Other themes
+ * join neighbouring cells of a row with the same style into one run that
+ * also colors the gaps between them, which saves escapes on large outputs.
+ */
+enum style {STYLE_NONE, STYLE_WEEKEND, STYLE_RANGE, STYLE_HOLIDAY, STYLE_MARK, STYLE_TODAY, NUM_STYLES};
+
+struct theme {
+    const char *name;
+    const char *style[NUM_STYLES];
+    int join;       /* If set (to 1) cells of the same style share one escape */
+};
+
+const struct theme themes[] = {
+    {"default", {"", "", "\033[4m", HOLB, MRKB, WHTB}, 0},
+    {"none", {"", "", "", "", "", ""}, 0},
+    {"256", {"", "\033[38;5;244m", "\033[4m", "\033[38;5;231m\033[48;5;160m", "\033[38;5;16m\033[48;5;114m", "\033[38;5;16m\033[48;5;255m"}, 1},
+    {"truecolor", {"", "\033[38;2;140;140;140m", "\033[4m", "\033[38;2;255;255;255m\033[48;2;200;40;40m", "\033[38;2;0;0;0m\033[48;2;120;200;120m", "\033[38;2;0;0;0m\033[48;2;240;240;240m"}, 1},
+    {NULL, {NULL}, 0}
+};
+const struct theme *theme = &themes[0];
+
+/* Selected range of days (day numbers), select_first < 0 if none */
+long select_first = -1, select_last = -1;
+
+
+/* Per day values printed in place of day numbers (free/busy counts).
+ * count[i] belongs to day number first_day+i. NULL when not used.
+ */
+struct day_counts {
+    long first_day;
+    long num_days;
+    int *count;
+};
+struct day_counts *day_counts = NULL;
+
+/* Days to highlight. mark[i] is set if day number first_day+i is marked.
+ * NULL when not used.
+ */
+struct day_marks {
+    long first_day;
+    long num_days;
+    unsigned char *mark;
+};
+struct day_marks *day_marks = NULL;
+
+/* Holidays as a bitmap, one bit per day: bit i of bits[i/8] is set if day
+ * number first_day+i is a holiday. NULL when not used.
+ */
+struct day_bitmap {
+    long first_day;
+    long num_days;
+    const unsigned char *bits;
+};
+struct day_bitmap *holidays = NULL;
+
+/* Print day of year numbers (1-366) in 4 character cells instead of day
+ * numbers. Cells come from julian_cells, "  1" to "366", built once.
+ */
+int julian = 0;
+char julian_cells[367][3];
+pthread_once_t julian_once = PTHREAD_ONCE_INIT;
+
+/*  FUNCTION:   build_julian_cells
+ *  Brief:      Fill the table of day of year cells
+ */
+void build_julian_cells(){
+    for(int i = 0; i < 367; i++){
+        julian_cells[i][0] = (i >= 100) ? (char)('0' + i/100) : ' ';
+        julian_cells[i][1] = (i >= 10) ? (char)('0' + i/10%10) : ' ';
+        julian_cells[i][2] = (char)('0' + i%10);
+    }
+}
+
+
+/* Current date: day, month (0=January) and year, 0 until looked up */
+int current_date[3];
+
+/*  FUNCTION:   refresh_current_date
+ *  Brief:      Look up the current date again (for long runs such as --watch).
+ *              Must not run while other threads render.
+ *
+ *  Return:     1 if the date changed, 0 if it did not.
+ */
+int refresh_current_date(){
+    time_t t = time(NULL);
+    struct tm tm = *localtime(&t);
+    int date[3] = {tm.tm_mday, tm.tm_mon, tm.tm_year+1900};
+    int changed = (memcmp(date, current_date, sizeof(date)) != 0);
+    memcpy(current_date, date, sizeof(date));
+    return changed;
+}
 
 /* FUNCTION:    get_current_date
- * Brief:       Get current date 
+ * Brief:       Get current date. Looked up once per run (and again only by
+ *              refresh_current_date), so renders running on several threads
+ *              all read the same answer.
  * Return:
  *          Pointer to int array:
  *           date[0] = day
@@ -53,13 +279,10 @@ int num_days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
  *           date[2] = year
  */
 int *get_current_date(){
-    static int date[3];
-    time_t t = time(NULL);
-    struct tm tm = *localtime(&t);
-    date[0] = tm.tm_mday;
-    date[1] = tm.tm_mon;
-    date[2] = tm.tm_year+1900;
-    return date;
+    if(current_date[2] == 0){
+        refresh_current_date();
+    }
+    return current_date;
 }
 
 
@@ -92,14 +315,75 @@ int month_start_day(int y, int m){
     int leaps = ((y-1)/4) + ((y-1)/400) - ((y-1)/100);
     total_days += leaps;
 
-    /* Calculate days passed until month m of year y */
-    for(int i = 0; i < m; i++){
-        total_days += num_days[i];
-    }
+    /* Days passed until month m of year y */
+    total_days += days_before_month[is_leap_year(y)][m];
 
     return total_days%7;
 }
 
+/*  FUNCTION:   day_number
+ *  Brief:      Calculate the number of days passed since 01.01.01
+ *  Param:
+ *              y: year
+ *              m: month (where 0=January, 1=February...)
+ *              d: day of month (starting at 1)
+ *
+ *  Return:     Day number, where 0=01.01.01 (a Monday), negative before it
+ */
+long day_number(int y, int m, int d){
+    long py = y-1;
+    /* Leap years before y, rounded down so year 0 (a leap year) and earlier
+       years count like the proleptic Gregorian calendar */
+    long leap = (py >= 0) ? py/4 - py/100 + py/400 : (py-3)/4 - (py-99)/100 + (py-399)/400;
+    return py*365 + leap + days_before_month[is_leap_year(y)][m] + d-1;
+}
+
+/*  FUNCTION:   day_to_date
+ *  Brief:      Calculate the date of a day number (inverse of day_number)
+ *  Param:
+ *              dn: day number, where 0=01.01.01
+ *              y: set to year
+ *              m: set to month (where 0=January, 1=February...)
+ *              d: set to day of month (starting at 1)
+ */
+void day_to_date(long dn, int *y, int *m, int *d){
+    /* 146097 days per 400 years, 36524 per 100, 1461 per 4 and 365 per year.
+       The last year of each cycle is the one that may be a day longer.
+    */
+    long n400 = dn/146097;
+    long r = dn%146097;
+    long n100 = r/36524;
+    if(n100 == 4)
+        n100 = 3;
+    r -= n100*36524;
+    long n4 = r/1461;
+    r %= 1461;
+    long n1 = r/365;
+    if(n1 == 4)
+        n1 = 3;
+    r -= n1*365;
+    *y = (int)(n400*400 + n100*100 + n4*4 + n1 + 1);
+
+    const int *before = days_before_month[is_leap_year(*y)];
+    int month = (int)r/32;
+    if(r >= before[month+1])
+        month++;
+    *m = month;
+    *d = (int)r - before[month] + 1;
+}
+
+/*  FUNCTION:   day_of_week
+ *  Brief:      Calculate the day of week of a day number
+ *  Param:
+ *              dn: day number, where 0=01.01.01
+ *
+ *  Return:     Day of week, where 0=Sunday, 1=Monday ... 6=Saturday
+ */
+int day_of_week(long dn){
+    /* Also for days before 01.01.01 */
+    return (int)(((dn+1)%7 + 7)%7);
+}
+
 
 /*  FUNCTION:   month_start_week
  *  Brief:      Calculate what week a month at a specific year starts with
@@ -112,10 +396,8 @@ int month_start_day(int y, int m){
 int month_start_week(int y, int m){
     int total_days = month_start_day(y, 0);
     int week = 1;
-    for(int i = 0; i < m; i++){
-        total_days += num_days[i];
-    }
-    
+    total_days += days_before_month[is_leap_year(y)][m];
+
     week += total_days/7;
     return week;   
 }
@@ -138,88 +420,279 @@ int year_char_len(int y){
     return count;
 }
 
+
+/* Fiscal calendar
+ *
+ * Fiscal years of 52 or 53 whole weeks, ending on the same weekday every
+ * year: either the last one in a given month, or the one nearest to the end
+ * of that month (up to three days into the next month). A fiscal year is
+ * named by the calendar year it ends in. Each quarter has three periods of
+ * 4 and 5 weeks (4-4-5, 4-5-4 or 5-4-4); a 53rd week goes to the last period.
+ *
+ * The period boundaries of a fiscal year are computed once and kept in a
+ * small cache shared by all renders, including the threads of -c.
+ */
+#define FISCAL_CACHE 64
+
+struct fiscal {
+    int period_weeks[3];    /* Weeks of the periods of a quarter, e.g. 4, 4, 5 */
+    int month;              /* Month the year ends in */
+    int dow;                /* Weekday the year ends on, 0=Sunday */
+    int nearest;            /* If set (to 1) end on the dow nearest to the end of month */
+};
+struct fiscal *fiscal = NULL;
+
+struct fiscal_year {
+    int year;               /* Calendar year it ends in, 0 for an empty cache entry */
+    long period[13];        /* First day of each period, period[12] is the first day of the next year */
+};
+struct fiscal_year fiscal_cache[FISCAL_CACHE];
+pthread_mutex_t fiscal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*  FUNCTION:   parse_fiscal
+ *  Brief:      Parse a fiscal calendar, e.g. "4-4-5" and "last-sat-jan"
+ *  Param:
+ *              periods: weeks of the periods of a quarter, 4-4-5, 4-5-4 or 5-4-4
+ *              end: "last" or "nearest", weekday and month the year ends on
+ *
+ *  Return:     The fiscal calendar (allocated), NULL if it was not valid.
+ */
+struct fiscal *parse_fiscal(const char *periods, const char *end){
+    struct fiscal f = {{0, 0, 0}, -1, -1, 0};
+    char rule[8], dow[4], month[4];
+    if(sscanf(periods, "%d-%d-%d", &f.period_weeks[0], &f.period_weeks[1], &f.period_weeks[2]) != 3 || f.period_weeks[0] + f.period_weeks[1] + f.period_weeks[2] != 13){
+        return NULL;
+    }
+    for(int i = 0; i < 3; i++){
+        if(f.period_weeks[i] != 4 && f.period_weeks[i] != 5)
+            return NULL;
+    }
+    if(sscanf(end, "%7[a-z]-%3[a-z]-%3[a-z]", rule, dow, month) != 3){
+        return NULL;
+    }
+    if(strcmp(rule, "nearest") == 0)
+        f.nearest = 1;
+    else if(strcmp(rule, "last") != 0)
+        return NULL;
+    for(int i = 0; i < 7; i++){
+        if(strcasecmp(dow, weekday_abbr[i]) == 0)
+            f.dow = i;
+    }
+    for(int i = 0; i < 12; i++){
+        if(strncasecmp(month, month_name[i], 3) == 0)
+            f.month = i;
+    }
+    if(f.dow < 0 || f.month < 0){
+        return NULL;
+    }
+    struct fiscal *copy = malloc(sizeof(*copy));
+    *copy = f;
+    return copy;
+}
+
+/*  FUNCTION:   fiscal_year_end
+ *  Brief:      Calculate the last day of the fiscal year ending in year y
+ */
+long fiscal_year_end(int y){
+    long month_end = day_number(y, fiscal->month, num_days[is_leap_year(y)][fiscal->month]);
+    long end = month_end - (day_of_week(month_end) - fiscal->dow + 7)%7;
+    if(fiscal->nearest && month_end - end > 3)
+        end += 7;
+    return end;
+}
+
+/*  FUNCTION:   fiscal_year
+ *  Brief:      Get the period boundaries of a fiscal year, computing them
+ *              on the first use
+ *  Param:
+ *              y: calendar year the fiscal year ends in
+ *              fy: set to the fiscal year
+ */
+void fiscal_year(int y, struct fiscal_year *fy){
+    struct fiscal_year *entry = &fiscal_cache[y%FISCAL_CACHE];
+    pthread_mutex_lock(&fiscal_lock);
+    if(entry->year != y){
+        long start = fiscal_year_end(y-1) + 1;
+        long next = fiscal_year_end(y) + 1;
+        entry->year = y;
+        for(int p = 0; p < 12; p++){
+            entry->period[p] = start;
+            start += fiscal->period_weeks[p%3]*7;
+        }
+        /* A 53rd week lengthens the last period */
+        entry->period[12] = next;
+    }
+    *fy = *entry;
+    pthread_mutex_unlock(&fiscal_lock);
+}
+
+/*  FUNCTION:   fiscal_year_of
+ *  Brief:      Get the fiscal year a day belongs to
+ */
+void fiscal_year_of(long day, struct fiscal_year *fy){
+    int y, m, d;
+    day_to_date(day, &y, &m, &d);
+    fiscal_year(y, fy);
+    if(day >= fy->period[12]){
+        fiscal_year(y+1, fy);
+    } else if(day < fy->period[0] && y > 1){
+        /* Days of 0001 before fiscal year 1 starts count to it, there is no year 0 */
+        fiscal_year(y-1, fy);
+    }
+}
+
+/*  FUNCTION:   fiscal_week
+ *  Brief:      Calculate the fiscal week (1-53) of a day
+ */
+int fiscal_week(long day){
+    struct fiscal_year fy;
+    fiscal_year_of(day, &fy);
+    return (int)((day - fy.period[0])/7) + 1;
+}
+
 /*  FUNCTION:   print_spaces
  *  Brief:      Print n number of spaces
  *  Param:
+ *              fp: stream to print to
  *              n: number of spaces
 */
-void print_spaces(int n){
-    for(int i = 0; i < n; i++){
-        printf(" ");
+void print_spaces(FILE *fp, int n){
+    static const char spaces[] = "                                                                ";
+    while(n > 0){
+        int len = (n < (int)sizeof(spaces)-1) ? n : (int)sizeof(spaces)-1;
+        fwrite(spaces, 1, len, fp);
+        n -= len;
     }
 }
 
 /*  FUNCTION:   print_heading
  *  Brief:      Print formatted heading for calendar
  *  Param:
+ *              fp: stream to print to
  *              y: year
- *              m: month (to start print at)
+ *              m: month (to start print at, may be past December to continue into year y+1)
  *              n: number of headings to print
  *              w: If set to 1 - format heading to fit calendar with week numbers. 
                 s: If set to 1 - print both month and year in heading
  */
-void print_heading(int y, int m, int n, int w, int s){
-    int include_year = 0;
-    /* If year is to be included in heading */
-    if(s == 1){
-        include_year = year_char_len(y) + 1;
-    }
+void print_heading(FILE *fp, int y, int m, int n, int w, int s){
     /* Calculate spaces and print month names */
     for(int i = 0; i < n; i++){
-        int month_name_len = strlen(month_name[m+i]);
-        int num_spaces  = (20-(month_name_len+include_year))/2;
-        int remainder = (20-(month_name_len+include_year))%2;
+        int month = (m+i)%12;
+        int year = y + (m+i)/12;
+        int include_year = 0;
+        /* If year is to be included in heading */
+        if(s == 1){
+            include_year = year_char_len(year) + 1;
+        }
+        int month_name_len = strlen(month_name[month]);
+        int width = (julian) ? 27 : 20;
+        int num_spaces  = (width-(month_name_len+include_year))/2;
+        int remainder = (width-(month_name_len+include_year))%2;
         /* If w is set to 1 (i.e print calendar with week numbers)
            Print three additional spaces to get correct formatted output 
         */
-        print_spaces(num_spaces+(w*3));
-        printf("%s", month_name[m+i]);
+        print_spaces(fp, num_spaces+(w*3));
+        fprintf(fp, "%s", month_name[month]);
         if(s == 1){
-            printf(" %d", y);
+            fprintf(fp, " %d", year);
         }
         /* Add extra space if week numbers are to be included in output (+w)*/
-        print_spaces(num_spaces+remainder+2+w);
+        print_spaces(fp, num_spaces+remainder+2+w);
     }
 
-    printf("\n");
+    fprintf(fp, "\n");
     /* Print the name of days (Su Mo...)
         And if w is set format to fit the inclusion of week numbers
     */
     for(int j = 0; j < n; j++){
         if(w)
-            print_spaces(3);
-        printf("%s", day_names);
-        print_spaces(2+w);
+            print_spaces(fp, 3);
+        fprintf(fp, "%s", (julian) ? julian_day_names : day_names);
+        print_spaces(fp, 2+w);
     }
 
-    printf("\n");
+    fprintf(fp, "\n");
 }
 
 
+/*  FUNCTION:   month_styles
+ *  Brief:      Resolve the style of every day of a month
+ *  Param:
+ *              style: set to the style of day d at style[d] (d from 1)
+ *              y: year
+ *              m: month
+ *              days: number of days in the month
+ *              start: weekday of the first day (0=Sunday)
+ *              first: day number of the first day
+ */
+void month_styles(unsigned char *style, int y, int m, int days, int start, long first){
+    int *date = get_current_date();
+    for(int d = 1; d <= days; d++){
+        long day = first + d-1;
+        int dow = (start + d-1)%7;
+        int st = STYLE_NONE;
+        if(y == date[2] && m == date[1] && d == date[0]){
+            st = STYLE_TODAY;
+        } else if(day_marks && day - day_marks->first_day >= 0 && day - day_marks->first_day < day_marks->num_days && day_marks->mark[day - day_marks->first_day]){
+            st = STYLE_MARK;
+        } else if(holidays && day - holidays->first_day >= 0 && day - holidays->first_day < holidays->num_days && (holidays->bits[(day - holidays->first_day) >> 3] >> ((day - holidays->first_day) & 7)) & 1){
+            st = STYLE_HOLIDAY;
+        } else if(select_first >= 0 && day >= select_first && day <= select_last){
+            st = STYLE_RANGE;
+        } else if(dow == 0 || dow == 6){
+            st = STYLE_WEEKEND;
+        }
+        style[d] = (theme->style[st][0]) ? (unsigned char)st : STYLE_NONE;
+    }
+}
+
 /*  FUNCTION:   print_day_numbers
  *  Brief:      Prints three months in a unix cal formatted way
  *  Param:
+ *              fp: stream to print to
  *              y: year
- *              m: month (to start print at)
+ *              m: month (to start print at, may be past December to continue into year y+1)
  *              n: number of months to print
  *              w: If set to 1 - include week numbers. 
  *           
  */
-void print_day_numbers(int y, int m, int n, int w){
+void print_day_numbers(FILE *fp, int y, int m, int n, int w){
 
     int remaining_days = 0;
+    int year[n];
+    int month[n];
+    int days[n];
     int start_day[n];
     int days_printed[n];
     int week[n];
-    int *date = get_current_date();
+    long first_day[n];
+    unsigned char style[n][32];
+    int current = STYLE_NONE;
+    int cell = (julian) ? 4 : 3;
+
+    if(julian)
+        pthread_once(&julian_once, build_julian_cells);
 
-    /* Set variable values */
+    /* Set variable values. Each month carries its own year and leap status,
+       and its start day follows from the previous month instead of being
+       recomputed from year 1.
+    */
     for(int i = 0; i < n; i++){
-        remaining_days += num_days[m+i];
-        start_day[i] = month_start_day(y, m+i);
+        year[i] = y + (m+i)/12;
+        month[i] = (m+i)%12;
+        days[i] = num_days[is_leap_year(year[i])][month[i]];
+        remaining_days += days[i];
+        if(i == 0){
+            start_day[i] = month_start_day(year[i], month[i]);
+        } else {
+            start_day[i] = (start_day[i-1] + days[i-1])%7;
+        }
         days_printed[i] = 1;
+        first_day[i] = (i == 0) ? day_number(year[i], month[i], 1) : first_day[i-1] + days[i-1];
+        month_styles(style[i], year[i], month[i], days[i], start_day[i], first_day[i]);
         if(w)
-            week[i] = month_start_week(y, m+i);
+            week[i] = month_start_week(year[i], month[i]);
     }
 
     /* Decrement n to prevent segmentation fault */
@@ -230,194 +703,5268 @@ void print_day_numbers(int y, int m, int n, int w){
 
     /* Print day (and week) numbers loop */
     while(remaining_days > 0){
-        /* Print week number */
+        /* Print week number (fiscal week of the row's first day with --fiscal) */
         if(w){
-            if(day_pointer == 0 && days_printed[month_pointer] <= num_days[month_pointer+m]){
-                if(week[month_pointer] < 10){
-                    print_spaces(1);
+            if(day_pointer == 0 && days_printed[month_pointer] <= days[month_pointer]){
+                int shown = (fiscal) ? fiscal_week(first_day[month_pointer] + days_printed[month_pointer]-1) : week[month_pointer];
+                if(shown < 10){
+                    print_spaces(fp, 1);
                 }
-                printf("%d ", week[month_pointer]);
+                fprintf(fp, "%d ", shown);
                 week[month_pointer]++;
             } else if(day_pointer == 0){
-                    print_spaces(3);
+                    print_spaces(fp, 3);
             }
         }
         /* Handle cases where there should not be any number printed */
         if(start_day[month_pointer] > 0){
-            print_spaces(start_day[month_pointer]*3);
+            print_spaces(fp, start_day[month_pointer]*cell);
             day_pointer = start_day[month_pointer];
             start_day[month_pointer] = -1;
-        } else if(days_printed[month_pointer] > num_days[month_pointer+m]){
-            print_spaces((7-day_pointer)*3);
+        } else if(days_printed[month_pointer] > days[month_pointer]){
+            print_spaces(fp, (7-day_pointer)*cell);
             day_pointer = 7;
         } else {
-            /* Set color (and print) if date to be printed is the current date */
-            if(y == date[2] && m+month_pointer == date[1] && days_printed[month_pointer] == date[0]){
-                printf(WHTB);
-                if(days_printed[month_pointer] < 10){
-                    print_spaces(1);
-                }
-                printf("%d", days_printed[month_pointer]);
-                printf(RST);
-                print_spaces(1);
-                days_printed[month_pointer]++;
-                day_pointer++;
-                remaining_days--;
-            /* Print all other day numbers (not current date)*/
+            /* Print the day's count instead of its number when counts are shown */
+            int shown = days_printed[month_pointer];
+            if(day_counts){
+                long i = first_day[month_pointer] + shown-1 - day_counts->first_day;
+                shown = (i >= 0 && i < day_counts->num_days) ? day_counts->count[i] : 0;
+                if(shown > 99)
+                    shown = 99;
+            } else if(julian){
+                shown += days_before_month[is_leap_year(year[month_pointer])][month[month_pointer]];
+            }
+            /* Switch style only where it changes */
+            int st = style[month_pointer][days_printed[month_pointer]];
+            if(st != current){
+                if(current)
+                    fputs(RST, fp);
+                if(st)
+                    fputs(theme->style[st], fp);
+                current = st;
+            }
+            if(day_counts && shown == 0){
+                print_spaces(fp, cell-2);
+                fprintf(fp, ".");
+            } else if(julian){
+                fwrite(julian_cells[shown], 1, 3, fp);
             } else {
-                if(days_printed[month_pointer] < 10){
-                    print_spaces(1);
+                if(shown < 10){
+                    print_spaces(fp, 1);
                 }
-                printf("%d ", days_printed[month_pointer]);
-                days_printed[month_pointer]++;
-                day_pointer++;
-                remaining_days--;
+                fprintf(fp, "%d", shown);
             }
+            days_printed[month_pointer]++;
+            day_pointer++;
+            remaining_days--;
+            /* With a joining theme the gap keeps the style up to a next cell of the same style in this row */
+            if(current && (!theme->join || day_pointer%7 == 0 || days_printed[month_pointer] > days[month_pointer] || style[month_pointer][days_printed[month_pointer]] != current)){
+                fputs(RST, fp);
+                current = STYLE_NONE;
+            }
+            print_spaces(fp, 1);
         }
         /* Move to next month */
         if(day_pointer%7 == 0 && month_pointer != n){
-            print_spaces(1+w);
+            print_spaces(fp, 1+w);
             month_pointer++;
             day_pointer = 0;
         /* Move to new line */
         } else if(day_pointer%7 == 0 && month_pointer == n){
-            printf("\n");
+            fprintf(fp, "\n");
             month_pointer = 0;
             day_pointer = 0;
         }
     }
-    printf("\n");
+    fprintf(fp, "\n");
 }
 
 /*  FUNCTION:   print_calendar
  *  Brief:      Uses three functions to print n (up to 12) number of months
  */
-void print_calendar(int y, int m, int n, int w, int s){
-    num_days[1] = (is_leap_year(y)) ? 29 : 28;
-    print_heading(y, m, n, w, s);
-    print_day_numbers(y, m, n, w);
+void print_calendar(FILE *fp, int y, int m, int n, int w, int s){
+    print_heading(fp, y, m, n, w, s);
+    print_day_numbers(fp, y, m, n, w);
 }
 
 /*  FUNCTION:   print_help
  *  Brief:      Print formatted how-to-use instructions
  */
 void print_help(){
-    printf("How to use:\n[compiled program] [options]\n\nRunning program without arguments will print current month\n\nOptions:\n -y <num>\tYear to print\n\t\t  Note: Prints whole year if -m is not specified\n -m <num>\tMonth to print\n\t\t  Note: January = 0\n -w\t\tPrint week numbers\n -n <num>\tNumber of months to print\n\t\t  Note: Will only print until end of year\n\t\t\tStarts from current month if -m is not specified\n\t\t\tPrints whole year if used with -y without -m\n -h\t\tDisplay this help page\n");
+    printf("How to use:\n[compiled program] [options]\n\nRunning program without arguments will print current month\n\nDate queries (on the given date(s), or on every line of stdin):\n dow <date>\tWeekday of a date (2024-03-05), e.g. Tue\n doy <date>\tDay of year (1-366)\n week <date>\tISO week, e.g. 2024-W10\n diff <date> <date>\n\t\tDays from the first date to the second\n add <date> <n> <unit>\n\t\tDate n (+3, -1...) days, weeks, months or years later\n stats <date> <date>\n\t\tDays of each weekday, months starting on each weekday,\n\t\tleap days and months with five weekends in a range\n\t\t  Note: Not read from stdin\n\nTimestamp conversion:\n epoch [<offset>]\tReplace the Unix timestamp starting each line of stdin\n\t\twith its date, time, weekday and ISO week\n\t\t  Note: offset is a UTC offset (+01:00), utc (default)\n\t\t\tor local\n annotate <file> [weekday | week | fiscal <periods> <end>]\n\t\tPrefix every line of a log file with the weekday, ISO\n\t\tweek (default) or fiscal period of the date or Unix\n\t\ttimestamp it starts with\n\nOptions:\n -y <num>\tYear to print\n\t\t  Note: Prints whole year if -m is not specified\n -m <num>\tMonth to print\n\t\t  Note: January = 0\n -w\t\tPrint week numbers\n -j\t\tPrint day of year numbers (1-366) instead of day numbers\n -n <num>\tNumber of months to print\n\t\t  Note: Continues into the following years\n\t\t\tStarts from current month if -m is not specified\n\t\t\tPrints whole year if used with -y without -m\n --from <y-m>\tFirst month of a continuous range, e.g. 2023-11\n\t\t  Note: January = 1 (ISO style)\n --to <y-m>\tLast month of a continuous range, e.g. 2025-02\n\t\t  Note: Starts from current month if --from is not specified\n -c <num>\tNumber of consecutive years to print, starting at -y\n\t\t  Note: Rendered in parallel and streamed with constant memory\n -d\t\tUsed with -c: write a deduplicated archive where each\n\t\tdistinct year body is stored once\n -z\t\tUsed with -c: compress the output (fast LZ codec)\n -r <file>\tPrint the plain calendars stored in an exported file\n\t\t  Note: Reads compressed and deduplicated exports\n -o <file>\tWrite output to file instead of stdout\n --busy <file>\tEvent file of one person, may be repeated\n\t\t  Note: Prints the number of busy people on each day\n\t\t\tinstead of day numbers (\".\" if nobody is busy)\n --slots <minutes> <num>\n\t\tUsed with --busy: find the first <num> free slots of\n\t\t<minutes> shared by everyone, highlight and list them\n\t\t  Note: Searches working hours on Monday to Friday from the\n\t\t\tfirst printed month (from now without -y or --from)\n --hours <h-h>\tWorking hours for --slots, default 09:00-17:00\n\t\t  Note: Also limits the hours shown by --week\n --week <date>\tPrint the week containing <date> (2024-03-05 or \"now\")\n\t\twith one row per hour and the --events and --rules\n\t\tevents placed into it\n\t\t  Note: -n prints that many weeks\n --events <file>\tEvent file (calendar), may be repeated\n\t\t  Note: Files named *.csv use commas between fields\n\t\t\tDays with events are highlighted\n --store <file>\tEvent store, used like --events. Only the events of the\n\t\tprinted time are read\n --store-add <file>\tAppend the events on stdin to a store\n\t\t  Note: Compacts the store when its log has grown large\n --compact <file>\tMerge the log of a store into its index\n --fiscal <periods> <end>\n\t\tFiscal calendar of 52/53 week years: periods is 4-4-5,\n\t\t4-5-4 or 5-4-4, end is when the year ends, e.g.\n\t\tlast-sat-jan or nearest-sat-jan (nearest to January 31)\n\t\t  Note: -w shows fiscal weeks, period starts are\n\t\t\thighlighted and the periods are listed\n --theme <name>\tColors: default, none, 256 (256 color terminals) or\n\t\ttruecolor (24 bit). The 256 and truecolor themes also\n\t\tdim weekends\n --select <date>..<date>\n\t\tUnderline a range of days, e.g. 2024-03-04..2024-03-15\n --ics\t\tWrite the events, rule occurrences, holidays and cron\n\t\tfire times of the printed months as iCalendar instead\n --grep <words>\tHighlight the days with events holding all of the\n\t\twords, instead of all days with events\n --watch\tKeep printing the months, updated whenever an --events\n\t\tor --store file changes\n --holidays <file>\tHighlight the days of a holiday list or compiled day file\n\t\t  Note: Lists hold a day (2024-12-25) or range of days\n\t\t\t(2024-07-15..2024-08-09) per line\n --compile-days <list> <file>\n\t\tCompile a holiday list into a day file\n --rules <file>\tRecurrence rule file, may be repeated\n --agenda <num>\tList the next <num> events of all --events and --rules\n\t\tfiles instead of printing a calendar\n\t\t  Note: Starts from the first printed month (from now\n\t\t\twithout -y or --from)\n --conflicts\tHighlight days with overlapping events of the --events\n\t\tcalendars and list the overlaps\n --cron <expr>\tCron expression (\"0 9 * * 1-5\"), may be repeated.\n\t\tHighlights the days it fires on and lists its next fire times\n\t\t  Note: Listed from the first printed month (from now\n\t\t\twithout -y or --from)\n --crontab <file>\tSame as --cron for every job of a crontab file\n --fires <num>\tNumber of fire times listed per cron expression, default 5\n -h\t\tDisplay this help page\n");
 }
 
-/*  FUNCTION:   print_year
- *  Brief:      Print the whole year with year heading
+/*  FUNCTION:   print_year_heading
+ *  Brief:      Print the centered year heading of a whole year
  *  Param:      
+ *              fp: stream to print to
  *              y: year
- *              w: If set (to 1) include week numbers
+ *              w: If set (to 1) center for calendar with week numbers
  */
-void print_year(int y, int w){
-    int heading_len = (w) ? 78 : 64;
+void print_year_heading(FILE *fp, int y, int w){
+    int heading_len = (julian) ? ((w) ? 99 : 85) : ((w) ? 78 : 64);
     int year_len = year_char_len(y);
     int num_spaces = (heading_len-year_len)/2;
-    printf("\n");
-    print_spaces(num_spaces);
-    printf("%d", y);
-    printf("\n\n");
+    fprintf(fp, "\n");
+    print_spaces(fp, num_spaces);
+    fprintf(fp, "%d", y);
+    fprintf(fp, "\n\n");
+}
+
+/*  FUNCTION:   print_year_body
+ *  Brief:      Print the twelve months of a year, three per row, without year heading.
+ *              Only depends on the weekday of January 1st and leap status
+ *              (and today's date), so there are 14 distinct bodies.
+ *  Param:      
+ *              fp: stream to print to
+ *              y: year
+ *              w: If set (to 1) include week numbers
+ */
+void print_year_body(FILE *fp, int y, int w){
     for(int i = 0; i < 4; i++){
-        print_calendar(y, i*3, 3, w, 0);
-        printf("\n");
+        print_calendar(fp, y, i*3, 3, w, 0);
+        fprintf(fp, "\n");
     }
 }
 
-/*  FUNCTION:   run
- *  Brief:      Handle input arguments and run program accordingly
+/*  FUNCTION:   print_year
+ *  Brief:      Print the whole year with year heading
  *  Param:      
+ *              fp: stream to print to
+ *              y: year
+ *              w: If set (to 1) include week numbers
+ */
+void print_year(FILE *fp, int y, int w){
+    print_year_heading(fp, y, w);
+    print_year_body(fp, y, w);
+}
+
+/*  FUNCTION:   print_months
+ *  Brief:      Print n consecutive months as one continuous stream, three per row.
+ *              Rows may cross into following years. If they do, every heading
+ *              carries its own year.
+ *  Param:
+ *              fp: stream to print to
  *              y: year
  *              m: month (to start print from)
- *              n: How many month (forward) to print. Or until end of year.
- *                 Ex. -n 13 prints (with no -m specified) prints remaining month of current year. 
- *                 Ex 2. -m 10 -n 3 will only print last two months.
+ *              n: number of months to print
  *              w: If set (to 1) include week numbers
  */
-int run(int y, int m, int n, int w){
-    int *date = get_current_date();
-    int s = 0;
-    if(y > 0 && m < 0){
-        print_year(y, w);
-        return 0;
-    }
-    if(y < 1){
-        y = date[2];
-    }
-    if(m < 0){
-        m = date[1];
-    }
-    if(n == 12){
-        print_year(y, w);
-        return 0;
-    } else if(m+n > 12){
-        n = 12 - m;
-    } else if(n < 1){
-        n = 1;
-    }
+void print_months(FILE *fp, int y, int m, int n, int w){
+    int s = (n == 1 || m+n > 12) ? 1 : 0;
     if(n > 3){
         while(n > 3){
-            printf("\n");
-            print_calendar(y, m, 3, w, 0);
+            fprintf(fp, "\n");
+            print_calendar(fp, y, m, 3, w, s);
             m += 3;
+            y += m/12;
+            m %= 12;
             n -= 3;
         }
-        printf("\n");
-        print_calendar(y, m, n, w, 0);
+        fprintf(fp, "\n");
+    }
+    print_calendar(fp, y, m, n, w, s);
+}
+
+/*  FUNCTION:   parse_year_month
+ *  Brief:      Parse a year and month written as "2023-11" (January = 1)
+ *  Param:
+ *              str: string to parse
+ *              y: set to parsed year
+ *              m: set to parsed month (where 0=January, 1=February...)
+ *
+ *  Return:     1 if str was a valid year and month, 0 if it was not.
+ */
+int parse_year_month(const char *str, int *y, int *m){
+    char *end;
+    long year = strtol(str, &end, 10);
+    if(end == str || *end != '-' || year < 1 || year > INT_MAX){
         return 0;
     }
-    if(n == 1){
-        s = 1;
+    str = end+1;
+    long month = strtol(str, &end, 10);
+    /* Nothing may follow the month */
+    if(end == str || *end != '\0' || month < 1 || month > 12){
+        return 0;
     }
-    print_calendar(y, m, n, w, s);
-    return 0;
+    *y = (int)year;
+    *m = (int)month-1;
+    return 1;
 }
 
+/*  FUNCTION:   month_span
+ *  Brief:      Count the months of a --from/--to range
+ *  Param:
+ *              from_y, from_m: first month
+ *              to_y, to_m: last month (to_m < 0 if not given)
+ *              n: -n (as given), the number of months without to_m
+ *
+ *  Return:     Number of months, 0 if the range is empty, too long to
+ *              print or ends after year INT_MAX.
+ */
+long month_span(int from_y, int from_m, int to_y, int to_m, int n){
+    long first = (long)from_y*12 + from_m;
+    long last = (to_m >= 0) ? (long)to_y*12 + to_m : first + ((n > 0) ? n-1 : 0);
+    /* Callers add the month of the year to the count as an int */
+    if(last < first || last - first >= INT_MAX - 12 || last > (long)INT_MAX*12 + 11){
+        return 0;
+    }
+    return last - first + 1;
+}
 
-int main(int argc, char *argv[]){
-    int y = 0, m = -1, n = 0, w = 0;
+/* Output compression
+ *
+ * A small LZ77 codec using the LZ4 block layout: each sequence is a token
+ * byte (literal length << 4 | match length - 4), extra length bytes when a
+ * field is 15, the literals, and a 2 byte little endian match offset. The
+ * last sequence only carries literals.
+ *
+ * A compressed stream starts with LZ_MAGIC followed by independent blocks:
+ * 4 byte raw length, 4 byte compressed length (both little endian), data.
+ * Blocks never reference each other, so they can be compressed in parallel.
+ * Readers reject blocks of more than LZ_BLOCK_MAX raw bytes (written blocks
+ * hold one export chunk, a few hundred KiB at most).
+ */
+#define LZ_MAGIC "CALZ"
+#define LZ_BLOCK_MAX (1 << 24)
+#define LZ_HASH_BITS 13
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
 
-    for(int i = 1; i < argc; i++){
-        char c = argv[i][1];
-        switch(c){
-            case 'w':
-                w = 1;
-                break;
-            case 'n':
-                if(argv[i+1]){
-                    n = atoi(argv[i+1]);
-                    i += 1;
-                    break;
-                } else {
-                    print_help();
-                    return 0;
-                }
-            case 'm':
-                if(argv[i+1]){
-                    m = atoi(argv[i+1]);
-                    i += 1;
-                    break;
-                } else {
-                    print_help();
-                    return 0;
-                }
-            case 'y':
-                if(argv[i+1]){
-                    y = atoi(argv[i+1]);
-                    i += 1;
-                    break;
-                } else {
-                    print_help();
-                    return 0;
-                }
-            default:
-                print_help();
-                return 0;
+/*  FUNCTION:   lz_bound
+ *  Brief:      Worst case compressed size of n bytes
+ */
+size_t lz_bound(size_t n){
+    return n + n/255 + 16;
+}
+
+/*  FUNCTION:   lz_put_length
+ *  Brief:      Write the extra bytes of a token length field that was 15 or more
+ *  Return:     Pointer past the written bytes
+ */
+unsigned char *lz_put_length(unsigned char *op, size_t len){
+    while(len >= 255){
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/*  FUNCTION:   lz_compress
+ *  Brief:      Compress a block
+ *  Param:
+ *              src: bytes to compress
+ *              n: number of bytes
+ *              dst: output buffer of at least lz_bound(n) bytes
+ *
+ *  Return:     Compressed size
+ */
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst){
+    static __thread unsigned int table[1 << LZ_HASH_BITS];
+    unsigned char *op = dst;
+    size_t anchor = 0;
+    size_t i = 0;
+
+    memset(table, 0, sizeof(table));
+    while(n >= LZ_MIN_MATCH && i + LZ_MIN_MATCH <= n){
+        unsigned int seq;
+        memcpy(&seq, src+i, 4);
+        unsigned int h = (seq*2654435761u) >> (32-LZ_HASH_BITS);
+        /* Positions are stored +1 so that 0 means empty */
+        size_t ref = table[h];
+        table[h] = (unsigned int)i + 1;
+        if(ref == 0 || i - (ref-1) > LZ_MAX_OFFSET || memcmp(src+ref-1, src+i, 4) != 0){
+            i++;
+            continue;
+        }
+        ref--;
+
+        size_t match_len = LZ_MIN_MATCH;
+        while(i + match_len < n && src[ref+match_len] == src[i+match_len]){
+            match_len++;
+        }
+
+        size_t lit_len = i - anchor;
+        size_t extra = match_len - LZ_MIN_MATCH;
+        unsigned char *token = op++;
+        *token = (unsigned char)(((lit_len < 15) ? lit_len : 15) << 4 | ((extra < 15) ? extra : 15));
+        if(lit_len >= 15){
+            op = lz_put_length(op, lit_len-15);
+        }
+        memcpy(op, src+anchor, lit_len);
+        op += lit_len;
+        *op++ = (unsigned char)((i-ref) & 0xff);
+        *op++ = (unsigned char)((i-ref) >> 8);
+        if(extra >= 15){
+            op = lz_put_length(op, extra-15);
+        }
+        i += match_len;
+        anchor = i;
+    }
+
+    /* Last literals */
+    size_t lit_len = n - anchor;
+    *op++ = (unsigned char)(((lit_len < 15) ? lit_len : 15) << 4);
+    if(lit_len >= 15){
+        op = lz_put_length(op, lit_len-15);
+    }
+    memcpy(op, src+anchor, lit_len);
+    op += lit_len;
+    return op - dst;
+}
+
+/*  FUNCTION:   lz_decompress
+ *  Brief:      Decompress a block
+ *  Param:
+ *              src: compressed bytes
+ *              n: number of compressed bytes
+ *              dst: output buffer
+ *              cap: size of the output buffer
+ *
+ *  Return:     Decompressed size, or -1 if the block is malformed.
+ */
+long lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap){
+    const unsigned char *ip = src;
+    const unsigned char *iend = src + n;
+    size_t op = 0;
+
+    while(ip < iend){
+        unsigned char token = *ip++;
+        size_t lit_len = token >> 4;
+        if(lit_len == 15){
+            unsigned char b;
+            do {
+                if(ip >= iend)
+                    return -1;
+                b = *ip++;
+                lit_len += b;
+            } while(b == 255);
         }
+        if(lit_len > (size_t)(iend-ip) || lit_len > cap-op)
+            return -1;
+        memcpy(dst+op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if(ip == iend)
+            break;
+
+        if(iend-ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if(match_len == 15){
+            unsigned char b;
+            do {
+                if(ip >= iend)
+                    return -1;
+                b = *ip++;
+                match_len += b;
+            } while(b == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+        if(offset == 0 || offset > op || match_len > cap-op)
+            return -1;
+        /* Byte by byte, since the match may overlap what it produces */
+        for(size_t k = 0; k < match_len; k++, op++){
+            dst[op] = dst[op-offset];
+        }
+    }
+    return (long)op;
+}
+
+/*  FUNCTION:   lz_put_u32
+ *  Brief:      Write a 32 bit little endian number
+ */
+void lz_put_u32(FILE *fp, size_t v){
+    unsigned char b[4] = {v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff};
+    fwrite(b, 1, 4, fp);
+}
+
+/*  FUNCTION:   lz_write_block
+ *  Brief:      Compress a block and write it to a compressed stream
+ *  Param:
+ *              fp: stream to write to
+ *              buf: bytes to compress
+ *              len: number of bytes
+ *
+ *  Return:     0 on success, 1 if memory ran out or the block was not written
+ */
+int lz_write_block(FILE *fp, const char *buf, size_t len){
+    unsigned char *z = malloc(lz_bound(len));
+    if(!z){
+        return 1;
+    }
+    size_t zlen = lz_compress((const unsigned char *)buf, len, z);
+    lz_put_u32(fp, len);
+    lz_put_u32(fp, zlen);
+    size_t put = fwrite(z, 1, zlen, fp);
+    free(z);
+    return (put != zlen);
+}
+
+struct lz_reader {
+    FILE *in;
+    unsigned char *raw;
+    size_t raw_len;
+    size_t pos;
+};
+
+/*  FUNCTION:   lz_read
+ *  Brief:      fopencookie read function of a decompressing stream.
+ *              Decompresses one block at a time.
+ */
+ssize_t lz_read(void *cookie, char *buf, size_t size){
+    struct lz_reader *r = cookie;
+    if(r->pos == r->raw_len){
+        unsigned char head[8];
+        size_t got = fread(head, 1, 8, r->in);
+        if(got == 0)
+            return 0;
+        if(got != 8)
+            return -1;
+        size_t raw_len = head[0] | head[1] << 8 | head[2] << 16 | (size_t)head[3] << 24;
+        size_t zlen = head[4] | head[5] << 8 | head[6] << 16 | (size_t)head[7] << 24;
+        if(raw_len > LZ_BLOCK_MAX || zlen > lz_bound(raw_len))
+            return -1;
+        unsigned char *z = malloc(zlen ? zlen : 1);
+        free(r->raw);
+        r->raw = malloc(raw_len ? raw_len : 1);
+        r->raw_len = r->pos = 0;
+        long out = -1;
+        if(z && r->raw && fread(z, 1, zlen, r->in) == zlen)
+            out = lz_decompress(z, zlen, r->raw, raw_len);
+        free(z);
+        if(out != (long)raw_len)
+            return -1;
+        r->raw_len = raw_len;
+        r->pos = 0;
+    }
+    size_t n = r->raw_len - r->pos;
+    if(n > size)
+        n = size;
+    memcpy(buf, r->raw + r->pos, n);
+    r->pos += n;
+    return n;
+}
+
+/*  FUNCTION:   lz_close
+ *  Brief:      fopencookie close function of a decompressing stream
+ */
+int lz_close(void *cookie){
+    struct lz_reader *r = cookie;
+    int ret = fclose(r->in);
+    free(r->raw);
+    free(r);
+    return ret;
+}
+
+/*  FUNCTION:   lz_open
+ *  Brief:      Wrap a compressed stream (positioned after LZ_MAGIC) in a stream
+ *              that reads the decompressed bytes. Closing it closes in.
+ */
+FILE *lz_open(FILE *in){
+    cookie_io_functions_t io = {lz_read, NULL, NULL, lz_close};
+    struct lz_reader *r = calloc(1, sizeof(*r));
+    r->in = in;
+    return fopencookie(r, "r", io);
+}
+
+
+/* Ordered ring
+ *
+ * Work split into numbered chunks that worker threads process in parallel
+ * and a single writer puts out in order (bulk export and log annotation).
+ * Chunk c is kept in slot c%RING_SLOTS, which it shares with chunk
+ * c-RING_SLOTS, so a worker that claimed chunk c waits until the writer has
+ * drained chunk c-RING_SLOTS. Waiting for the slot to merely look free is
+ * not enough: chunk c+RING_SLOTS could take it first and the writer would
+ * wait for chunk c forever. Memory use stays constant and workers stall
+ * when the output is slow.
+ *
+ * The ring only orders the chunks, the contents of the slots live next to
+ * it in the caller's struct. After a failure the remaining chunks are still
+ * claimed and drained, so every thread finishes, but their work is skipped.
+ */
+#define RING_SLOTS 16
+
+struct ordered_ring {
+    pthread_mutex_t lock;
+    pthread_cond_t slot_free;
+    pthread_cond_t slot_ready;
+    long ready[RING_SLOTS];     /* Chunk finished in each slot, -1 if none */
+    long next_chunk;
+    long num_chunks;
+    long drained;               /* Chunks put out by the writer */
+    int failed;                 /* Set when a chunk could not be processed or written */
+};
+
+/*  FUNCTION:   ring_init
+ *  Brief:      Set up an ordered ring
+ *  Param:
+ *              ring: ring to set up
+ *              num_chunks: number of chunks to process
+ */
+void ring_init(struct ordered_ring *ring, long num_chunks){
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->slot_free, NULL);
+    pthread_cond_init(&ring->slot_ready, NULL);
+    for(int i = 0; i < RING_SLOTS; i++){
+        ring->ready[i] = -1;
+    }
+    ring->next_chunk = 0;
+    ring->num_chunks = num_chunks;
+    ring->drained = 0;
+    ring->failed = 0;
+}
+
+/*  FUNCTION:   ring_claim
+ *  Brief:      Worker side. Claim the next chunk and wait until its slot is drained.
+ *  Param:
+ *              ring: ring to claim from
+ *              failed: set to 1 if an earlier chunk failed and the work can be skipped
+ *
+ *  Return:     Chunk claimed, -1 if all chunks are taken.
+ */
+long ring_claim(struct ordered_ring *ring, int *failed){
+    pthread_mutex_lock(&ring->lock);
+    long chunk = ring->next_chunk++;
+    if(chunk >= ring->num_chunks){
+        pthread_mutex_unlock(&ring->lock);
+        return -1;
+    }
+    while(ring->drained <= chunk - RING_SLOTS){
+        pthread_cond_wait(&ring->slot_free, &ring->lock);
+    }
+    *failed = ring->failed;
+    pthread_mutex_unlock(&ring->lock);
+    return chunk;
+}
+
+/*  FUNCTION:   ring_done
+ *  Brief:      Worker side. Hand a processed chunk to the writer.
+ *  Param:
+ *              ring: ring of the chunk
+ *              chunk: chunk whose slot is filled
+ *              failed: If set (to 1) the chunk could not be processed
+ */
+void ring_done(struct ordered_ring *ring, long chunk, int failed){
+    pthread_mutex_lock(&ring->lock);
+    ring->failed |= failed;
+    ring->ready[chunk%RING_SLOTS] = chunk;
+    pthread_cond_broadcast(&ring->slot_ready);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/*  FUNCTION:   ring_wait
+ *  Brief:      Writer side. Wait until a chunk is processed.
+ *  Param:
+ *              ring: ring of the chunk
+ *              chunk: next chunk to put out
+ *
+ *  Return:     1 if this or an earlier chunk failed, 0 otherwise.
+ */
+int ring_wait(struct ordered_ring *ring, long chunk){
+    pthread_mutex_lock(&ring->lock);
+    while(ring->ready[chunk%RING_SLOTS] != chunk){
+        pthread_cond_wait(&ring->slot_ready, &ring->lock);
+    }
+    int failed = ring->failed;
+    pthread_mutex_unlock(&ring->lock);
+    return failed;
+}
+
+/*  FUNCTION:   ring_drained
+ *  Brief:      Writer side. Release the slot of a chunk that was put out.
+ *  Param:
+ *              ring: ring of the chunk
+ *              chunk: chunk that was put out
+ *              failed: If set (to 1) the chunk could not be written
+ */
+void ring_drained(struct ordered_ring *ring, long chunk, int failed){
+    pthread_mutex_lock(&ring->lock);
+    ring->failed |= failed;
+    ring->ready[chunk%RING_SLOTS] = -1;
+    ring->drained++;
+    pthread_cond_broadcast(&ring->slot_free);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/*  FUNCTION:   ring_start
+ *  Brief:      Start worker threads
+ *  Param:
+ *              workers: set to the started threads
+ *              num_workers: number of threads wanted
+ *              worker: thread function
+ *              arg: argument of the thread function
+ *
+ *  Return:     Number of threads started, 0 if none could be started.
+ */
+long ring_start(pthread_t *workers, long num_workers, void *(*worker)(void *), void *arg){
+    long started = 0;
+    while(started < num_workers && pthread_create(&workers[started], NULL, worker, arg) == 0){
+        started++;
+    }
+    return started;
+}
+
+
+/* Bulk year export
+ *
+ * Years are rendered by producer threads in chunks of EXPORT_CHUNK_YEARS into
+ * an ordered ring of output buffers, which a single writer drains in order.
+ *
+ * In deduplicated mode producers only render year bodies and hash them, and
+ * the writer emits an archive where each distinct body is stored once:
+ *
+ *   CALDEDUP 1 <w> <j>\n                    w and julian (j) flags of the bodies
+ *   B <hash> <len>\n<len bytes of body>     first time a body is seen
+ *   Y <year> <hash>\n                       every year
+ *
+ * read_archive turns such an archive back into plain output.
+ *
+ * In compressed mode the output is an LZ_MAGIC stream with one block per
+ * chunk. Plain chunks are compressed by the producers, next to rendering,
+ * so compression scales with the number of workers. Deduplicated records
+ * are small and are compressed by the writer.
+ */
+#define EXPORT_CHUNK_YEARS 32
+
+#define ARCHIVE_MAGIC "CALDEDUP 1"
+/* Largest year body read from an archive, far above any year's size */
+#define ARCHIVE_BODY_MAX (1 << 20)
+
+struct export_slot {
+    char *buf;
+    size_t len;
+    /* Compressed mode: buf holds the compressed block of len bytes, raw_len before compression */
+    size_t raw_len;
+    /* Deduplicated mode: body of year i is buf[off[i]] up to buf[off[i+1]] */
+    size_t off[EXPORT_CHUNK_YEARS+1];
+    unsigned long long hash[EXPORT_CHUNK_YEARS];
+};
+
+struct export_ring {
+    struct ordered_ring order;
+    struct export_slot slot[RING_SLOTS];
+    int first_year;
+    int last_year;
+    int w;
+    int dedup;
+    int compress;
+};
+
+/*  FUNCTION:   hash_bytes
+ *  Brief:      64 bit FNV-1a hash of a buffer
+ *  Param:
+ *              buf: bytes to hash
+ *              len: number of bytes
+ *
+ *  Return:     Hash of the bytes
+ */
+unsigned long long hash_bytes(const char *buf, size_t len){
+    unsigned long long h = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; i++){
+        h ^= (unsigned char)buf[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*  FUNCTION:   export_producer
+ *  Brief:      Producer thread. Claims chunks from the ring in order and
+ *              renders the chunk's years into its slot.
+ *  Param:
+ *              arg: struct export_ring shared with the writer
+ */
+void *export_producer(void *arg){
+    struct export_ring *ring = arg;
+    long chunk;
+    int failed;
+    while((chunk = ring_claim(&ring->order, &failed)) >= 0){
+        struct export_slot *slot = &ring->slot[chunk%RING_SLOTS];
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *mem = (failed) ? NULL : open_memstream(&buf, &len);
+        if(!mem){
+            slot->buf = NULL;
+            slot->len = 0;
+            ring_done(&ring->order, chunk, 1);
+            continue;
+        }
+        int y = ring->first_year + (int)chunk*EXPORT_CHUNK_YEARS;
+        for(int i = 0; i < EXPORT_CHUNK_YEARS && y <= ring->last_year; i++, y++){
+            if(ring->dedup){
+                fflush(mem);
+                slot->off[i] = len;
+                print_year_body(mem, y, ring->w);
+            } else {
+                print_year(mem, y, ring->w);
+            }
+        }
+        fclose(mem);
+        if(ring->dedup){
+            int count = y - (ring->first_year + (int)chunk*EXPORT_CHUNK_YEARS);
+            slot->off[count] = len;
+            for(int i = 0; i < count; i++){
+                slot->hash[i] = hash_bytes(buf + slot->off[i], slot->off[i+1] - slot->off[i]);
+            }
+        } else if(ring->compress){
+            char *z = malloc(lz_bound(len));
+            slot->raw_len = len;
+            if(z){
+                len = lz_compress((unsigned char *)buf, len, (unsigned char *)z);
+            }
+            free(buf);
+            buf = z;
+        }
+        slot->buf = buf;
+        slot->len = len;
+        ring_done(&ring->order, chunk, !buf);
+    }
+    return NULL;
+}
+
+/*  FUNCTION:   export_years
+ *  Brief:      Print c consecutive years starting at y, rendered in parallel
+ *              and written in order with bounded memory.
+ *  Param:
+ *              fp: stream to print to
+ *              y: first year
+ *              c: number of years
+ *              w: If set (to 1) include week numbers
+ *              dedup: If set (to 1) write a deduplicated archive instead of plain output
+ *              compress: If set (to 1) compress the output
+ *
+ *  Return:     0 on success, 1 if a thread could not be started or the output
+ *              could not be rendered or written.
+ */
+int export_years(FILE *fp, int y, int c, int w, int dedup, int compress){
+    static struct export_ring ring;
+    unsigned long long *seen = NULL;
+    int num_seen = 0, seen_cap = 0;
+    long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_workers < 1){
+        num_workers = 1;
+    }
+    pthread_t workers[num_workers];
+
+    /* Look up today before any thread needs it */
+    get_current_date();
+
+    long num_chunks = (c + EXPORT_CHUNK_YEARS - 1)/EXPORT_CHUNK_YEARS;
+    ring_init(&ring.order, num_chunks);
+    ring.first_year = y;
+    ring.last_year = y + c - 1;
+    ring.w = w;
+    ring.dedup = dedup;
+    ring.compress = compress;
+
+    if(compress){
+        fputs(LZ_MAGIC, fp);
+    }
+
+    long started = ring_start(workers, num_workers, export_producer, &ring);
+    if(started == 0){
+        fprintf(stderr, "Could not start export threads\n");
+        return 1;
+    }
+
+    /* Writer: drain chunks in order, after a failure without writing them */
+    for(long chunk = 0; chunk < num_chunks; chunk++){
+        struct export_slot *slot = &ring.slot[chunk%RING_SLOTS];
+        int failed = ring_wait(&ring.order, chunk);
+        char *buf = slot->buf;
+        size_t len = slot->len;
+
+        if(!failed && dedup){
+            int first = ring.first_year + (int)chunk*EXPORT_CHUNK_YEARS;
+            char *rec_buf = NULL;
+            size_t rec_len = 0;
+            FILE *out = (compress) ? open_memstream(&rec_buf, &rec_len) : fp;
+            if(!out){
+                failed = 1;
+            }
+            if(out && chunk == 0){
+                fprintf(out, "%s %d %d\n", ARCHIVE_MAGIC, w, julian);
+            }
+            for(int i = 0; out && i < EXPORT_CHUNK_YEARS && first+i <= ring.last_year; i++){
+                int known = 0;
+                for(int j = 0; j < num_seen && !known; j++){
+                    known = (seen[j] == slot->hash[i]);
+                }
+                if(!known){
+                    size_t body_len = slot->off[i+1] - slot->off[i];
+                    fprintf(out, "B %016llx %zu\n", slot->hash[i], body_len);
+                    if(fwrite(buf + slot->off[i], 1, body_len, out) != body_len){
+                        failed = 1;
+                    }
+                    if(num_seen == seen_cap){
+                        int cap = (seen_cap) ? seen_cap*2 : 64;
+                        unsigned long long *grown = realloc(seen, cap*sizeof(*seen));
+                        if(!grown){
+                            failed = 1;
+                            break;
+                        }
+                        seen = grown;
+                        seen_cap = cap;
+                    }
+                    seen[num_seen++] = slot->hash[i];
+                }
+                fprintf(out, "Y %d %016llx\n", first+i, slot->hash[i]);
+            }
+            if(out && compress){
+                fclose(out);
+                failed |= lz_write_block(fp, rec_buf, rec_len);
+                free(rec_buf);
+            }
+        } else if(!failed && compress){
+            lz_put_u32(fp, slot->raw_len);
+            lz_put_u32(fp, len);
+            failed = (fwrite(buf, 1, len, fp) != len);
+        } else if(!failed){
+            failed = (fwrite(buf, 1, len, fp) != len);
+        }
+        free(buf);
+        ring_drained(&ring.order, chunk, failed || ferror(fp));
+    }
+
+    for(long i = 0; i < started; i++){
+        pthread_join(workers[i], NULL);
+    }
+    free(seen);
+    if(ring.order.failed){
+        fprintf(stderr, "Could not write the exported years\n");
+        return 1;
+    }
+    return 0;
+}
+
+/*  FUNCTION:   read_archive
+ *  Brief:      Reconstruct plain output from a deduplicated archive written by export_years
+ *  Param:
+ *              fp: stream to print to
+ *              in: archive to read
+ *
+ *  Return:     0 on success, 1 if the archive is malformed.
+ */
+int read_archive(FILE *fp, FILE *in){
+    struct body {
+        unsigned long long hash;
+        char *buf;
+        size_t len;
+    } *bodies = NULL;
+    int num_bodies = 0;
+    char header[64];
+    int w, j = 0;
+    int ret = 0;
+    char tag;
+
+    /* Archives written before the julian flag was stored hold only w */
+    if(!fgets(header, sizeof(header), in) || sscanf(header, ARCHIVE_MAGIC " %d %d", &w, &j) < 1){
+        return 1;
+    }
+    /* Headings must match the width of the stored bodies */
+    julian = j;
+    while(ret == 0 && fscanf(in, "%c ", &tag) == 1){
+        unsigned long long hash;
+        if(tag == 'B'){
+            size_t len;
+            if(fscanf(in, "%llx %zu", &hash, &len) != 2 || fgetc(in) != '\n' || len > ARCHIVE_BODY_MAX){
+                ret = 1;
+                break;
+            }
+            struct body *grown = realloc(bodies, (num_bodies+1)*sizeof(*bodies));
+            if(!grown){
+                ret = 1;
+                break;
+            }
+            bodies = grown;
+            char *buf = malloc(len ? len : 1);
+            if(!buf){
+                ret = 1;
+                break;
+            }
+            bodies[num_bodies].hash = hash;
+            bodies[num_bodies].len = len;
+            bodies[num_bodies].buf = buf;
+            if(fread(buf, 1, len, in) != len){
+                ret = 1;
+            }
+            num_bodies++;
+        } else if(tag == 'Y'){
+            int y;
+            int found = -1;
+            if(fscanf(in, "%d %llx\n", &y, &hash) != 2){
+                ret = 1;
+                break;
+            }
+            for(int i = 0; i < num_bodies && found < 0; i++){
+                if(bodies[i].hash == hash){
+                    found = i;
+                }
+            }
+            if(found < 0){
+                ret = 1;
+                break;
+            }
+            print_year_heading(fp, y, w);
+            fwrite(bodies[found].buf, 1, bodies[found].len, fp);
+        } else {
+            ret = 1;
+        }
+    }
+
+    for(int i = 0; i < num_bodies; i++){
+        free(bodies[i].buf);
+    }
+    free(bodies);
+    return ret;
+}
+
+/*  FUNCTION:   read_export
+ *  Brief:      Print the plain calendars stored in an exported file.
+ *              Handles compressed streams and deduplicated archives.
+ *  Param:
+ *              fp: stream to print to
+ *              in: exported file (closed when done)
+ *
+ *  Return:     0 on success, 1 if the file is malformed.
+ */
+int read_export(FILE *fp, FILE *in){
+    char magic[4];
+    int ret = 0;
+    if(fread(magic, 1, 4, in) == 4 && memcmp(magic, LZ_MAGIC, 4) == 0){
+        in = lz_open(in);
+    } else {
+        rewind(in);
+    }
+
+    int ch = fgetc(in);
+    ungetc(ch, in);
+    if(ch == ARCHIVE_MAGIC[0]){
+        ret = read_archive(fp, in);
+    } else {
+        char buf[1 << 16];
+        size_t len;
+        while((len = fread(buf, 1, sizeof(buf), in)) > 0){
+            fwrite(buf, 1, len, fp);
+        }
+        ret = ferror(in) ? 1 : 0;
+    }
+    fclose(in);
+    return ret;
+}
+
+/* Events
+ *
+ * Event files hold one event per line:
+ *
+ *   <start> <end> <summary>
+ *
+ * where start and end are written as 2024-03-05T09:00, or as 2024-03-05 for
+ * whole days (the end date is then included). Empty lines and lines starting
+ * with # are skipped. Files named *.csv separate the three fields with
+ * commas instead. Times are kept as minutes since 01.01.01 00:00.
+ */
+#define MINUTES_PER_DAY 1440
+
+struct event {
+    long start;
+    long end;       /* Exclusive */
+    char *summary;
+    int source;     /* Index of the file the event was read from */
+};
+
+struct event_list {
+    struct event *ev;
+    long count;
+    long cap;
+};
+
+/*  FUNCTION:   parse_time
+ *  Brief:      Parse a time written as 2024-03-05T09:00 or 2024-03-05
+ *  Param:
+ *              str: string to parse
+ *              end: If set (to 1) a date without time means the end of that day
+ *              t: set to minutes since 01.01.01 00:00
+ *
+ *  Return:     1 if str was a valid time, 0 if it was not.
+ */
+int parse_time(const char *str, int end, long *t){
+    int y, m, d, hh = 0, mm = 0, len = 0;
+    if(sscanf(str, "%d-%d-%d%n", &y, &m, &d, &len) != 3 || y < 1 || m < 1 || m > 12 || d < 1 || d > num_days[is_leap_year(y)][m-1]){
+        return 0;
+    }
+    if(str[len] == 'T'){
+        /* 24:00 is the end of the day, no later time of it */
+        if(sscanf(str+len, "T%d:%d", &hh, &mm) != 2 || hh < 0 || hh > 24 || mm < 0 || mm > 59 || (hh == 24 && mm > 0)){
+            return 0;
+        }
+    } else if(str[len] != '\0'){
+        return 0;
+    } else if(end){
+        hh = 24;
+    }
+    *t = day_number(y, m-1, d)*MINUTES_PER_DAY + hh*60 + mm;
+    return 1;
+}
+
+/*  FUNCTION:   current_time
+ *  Brief:      Get current local time
+ *  Return:     Minutes since 01.01.01 00:00
+ */
+long current_time(){
+    time_t t = time(NULL);
+    struct tm tm = *localtime(&t);
+    return day_number(tm.tm_year+1900, tm.tm_mon, tm.tm_mday)*MINUTES_PER_DAY + tm.tm_hour*60 + tm.tm_min;
+}
+
+/*  FUNCTION:   start_time
+ *  Brief:      Time searches and lists start at: the first printed month,
+ *              or now if no month is given
+ *  Param:
+ *              y: year from -y (< 1 if not given)
+ *              m: month from -m (< 0 if not given)
+ *              from_y: year from --from
+ *              from_m: month from --from (< 0 if not given)
+ *
+ *  Return:     Minutes since 01.01.01 00:00
+ */
+long start_time(int y, int m, int from_y, int from_m){
+    if(from_m >= 0){
+        return day_number(from_y, from_m, 1)*MINUTES_PER_DAY;
+    } else if(y > 0){
+        return day_number(y, (m < 0) ? 0 : m, 1)*MINUTES_PER_DAY;
+    }
+    return current_time();
+}
+
+/*  FUNCTION:   printed_days
+ *  Brief:      Calculate the range of days the arguments print, following
+ *              the same rules as main and run
+ *  Param:
+ *              y, m, n: -y, -m and -n (as given)
+ *              from_y, from_m, to_y, to_m: --from and --to (months < 0 if not given)
+ *              years: -c (0 if not given)
+ *              first: set to the first day number printed
+ *              last: set to the last day number printed
+ */
+void printed_days(int y, int m, int n, int from_y, int from_m, int to_y, int to_m, int years, long *first, long *last){
+    int *date = get_current_date();
+    long first_month, last_month;   /* Months since year 0 */
+    if(from_m >= 0 || to_m >= 0){
+        if(from_m < 0){
+            from_y = date[2];
+            from_m = date[1];
+        }
+        first_month = (long)from_y*12 + from_m;
+        last_month = first_month + month_span(from_y, from_m, to_y, to_m, n) - 1;
+    } else if(years > 0 || (y > 0 && m < 0) || n == 12){
+        if(y < 1)
+            y = date[2];
+        first_month = (long)y*12;
+        last_month = ((long)y + ((years > 0) ? years : 1))*12 - 1;
+    } else {
+        first_month = (long)((y > 0) ? y : date[2])*12 + ((m >= 0) ? m : date[1]);
+        last_month = first_month + ((n > 0) ? n-1 : 0);
+    }
+    *first = day_number(first_month/12, first_month%12, 1);
+    *last = day_number(last_month/12, last_month%12, num_days[is_leap_year(last_month/12)][last_month%12]);
+}
+
+/*  FUNCTION:   load_events
+ *  Brief:      Read an event file and add its events to a list.
+ *              Malformed lines are reported on stderr and skipped.
+ *  Param:
+ *              path: event file
+ *              source: index of the file, stored in its events
+ *              list: list to add events to
+ *
+ *  Return:     0 on success, 1 if the file could not be opened.
+ */
+int load_events(const char *path, int source, struct event_list *list){
+    FILE *in = fopen(path, "r");
+    char line[1024];
+    int line_number = 0;
+    size_t path_len = strlen(path);
+    int csv = (path_len > 4 && strcmp(path + path_len-4, ".csv") == 0);
+    if(!in){
+        fprintf(stderr, "Could not open %s for reading\n", path);
+        return 1;
+    }
+    while(fgets(line, sizeof(line), in)){
+        char start[64], end[64];
+        int summary = 0;
+        struct event e;
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0] == '\0' || line[0] == '#'){
+            continue;
+        }
+        if(csv){
+            /* Only the first two commas separate fields, the summary may hold more */
+            char *comma = strchr(line, ',');
+            if(comma){
+                *comma = ' ';
+                comma = strchr(comma, ',');
+                if(comma)
+                    *comma = ' ';
+            }
+        }
+        if(sscanf(line, "%63s %63s %n", start, end, &summary) < 2 || !parse_time(start, 0, &e.start) || !parse_time(end, 1, &e.end) || e.end <= e.start){
+            fprintf(stderr, "%s:%d: malformed event\n", path, line_number);
+            continue;
+        }
+        if(summary == 0){
+            summary = strlen(line);
+        }
+        e.summary = strdup(line + summary);
+        e.source = source;
+        if(list->count == list->cap){
+            list->cap = (list->cap) ? list->cap*2 : 256;
+            list->ev = realloc(list->ev, list->cap*sizeof(*list->ev));
+        }
+        list->ev[list->count++] = e;
+    }
+    fclose(in);
+    return 0;
+}
+
+/*  FUNCTION:   free_events
+ *  Brief:      Free the events of a list and empty it
+ */
+void free_events(struct event_list *list){
+    for(long i = 0; i < list->count; i++){
+        free(list->ev[i].summary);
+    }
+    free(list->ev);
+    list->ev = NULL;
+    list->count = 0;
+    list->cap = 0;
+}
+
+/*  FUNCTION:   format_time
+ *  Brief:      Write a time as 2024-03-05T09:00, the way event files hold it
+ *  Param:
+ *              buf: buffer of at least 17 characters (more for years past 9999)
+ *              size: size of the buffer
+ *              t: minutes since 01.01.01 00:00
+ */
+void format_time(char *buf, size_t size, long t){
+    int y, m, d;
+    day_to_date(t/MINUTES_PER_DAY, &y, &m, &d);
+    snprintf(buf, size, "%04d-%02d-%02dT%02ld:%02ld", y, m+1, d, (t%MINUTES_PER_DAY)/60, t%60);
+}
+
+/*  FUNCTION:   mark_events
+ *  Brief:      Mark the days in a range that have events
+ */
+struct day_marks *mark_events(const struct event_list *list, long first, long last){
+    struct day_marks *marks = calloc(1, sizeof(*marks));
+    marks->first_day = first;
+    marks->num_days = last - first + 1;
+    marks->mark = calloc(marks->num_days, 1);
+    for(long i = 0; i < list->count; i++){
+        long d0 = list->ev[i].start/MINUTES_PER_DAY;
+        long d1 = (list->ev[i].end-1)/MINUTES_PER_DAY;
+        if(d0 < first)
+            d0 = first;
+        if(d1 > last)
+            d1 = last;
+        for(long d = d0; d <= d1; d++){
+            marks->mark[d-first] = 1;
+        }
+    }
+    return marks;
+}
+
+/*  FUNCTION:   compare_events
+ *  Brief:      qsort comparison of events by start, then end
+ */
+int compare_events(const void *a, const void *b){
+    const struct event *ea = a, *eb = b;
+    if(ea->start != eb->start)
+        return (ea->start < eb->start) ? -1 : 1;
+    if(ea->end != eb->end)
+        return (ea->end < eb->end) ? -1 : 1;
+    return 0;
+}
+
+
+/* Word index
+ *
+ * Maps the words of event summaries to the events holding them, so --grep
+ * looks words up instead of reading every summary. Words are runs of
+ * letters and digits (any non-ASCII byte counts as a letter), lower cased
+ * and cut to WORD_MAX-1 bytes. A term matches the events holding all of
+ * its words, which are then mapped to their days: two events of the same
+ * day holding one word each do not match. The index is one block of
+ * memory, which is how stores keep it on disk (<file>.words, written when
+ * compacting):
+ *
+ *   WORDS_MAGIC, 4 byte number of words, 4 byte number of events
+ *   struct word_entry[num_words]    sorted by word
+ *   first and last day of every event, 4 bytes each
+ *   words, NUL terminated
+ *   posting lists: the sorted event numbers of each word as differences to
+ *   the previous one (the first to event 0), 7 bits per byte, high bit set
+ *   on all but the last byte of a number
+ *
+ * Stored indexes are checked against their size before use.
+ */
+#define WORDS_MAGIC "CALWORD2"
+#define WORDS_HEADER 16
+#define WORD_MAX 64
+
+struct word_entry {
+    uint32_t word;          /* Offsets from the start of the index */
+    uint32_t postings;
+    uint32_t count;         /* Number of events */
+    uint32_t reserved;
+};
+
+struct word_event {
+    uint32_t word;          /* Offset into the builder's word buffer */
+    uint32_t event;
+};
+
+/*  FUNCTION:   next_word
+ *  Brief:      Read the next word of a string
+ *  Param:
+ *              p: position in the string, advanced past the word
+ *              word: set to the lower cased word (WORD_MAX bytes)
+ *
+ *  Return:     Length of the word, 0 at the end of the string.
+ */
+int next_word(const char **p, char *word){
+    const unsigned char *s = (const unsigned char *)*p;
+    int len = 0;
+    while(*s && !isalnum(*s) && *s < 0x80)
+        s++;
+    for(; *s && (isalnum(*s) || *s >= 0x80); s++){
+        if(len < WORD_MAX-1)
+            word[len++] = (char)tolower(*s);
+    }
+    word[len] = '\0';
+    *p = (const char *)s;
+    return len;
+}
+
+/*  FUNCTION:   compare_word_events
+ *  Brief:      qsort_r comparison of word_event pairs by word, then event
+ */
+int compare_word_events(const void *a, const void *b, void *words){
+    const struct word_event *wa = a, *wb = b;
+    int c = (wa->word == wb->word) ? 0 : strcmp((const char *)words + wa->word, (const char *)words + wb->word);
+    if(c != 0)
+        return c;
+    return (wa->event > wb->event) - (wa->event < wb->event);
+}
+
+/*  FUNCTION:   build_word_index
+ *  Brief:      Build the word index of events
+ *  Param:
+ *              ev: events
+ *              count: number of events
+ *              size: set to the size of the index
+ *
+ *  Return:     The index (allocated).
+ */
+unsigned char *build_word_index(const struct event *ev, long count, size_t *size){
+    char *words = NULL;
+    size_t words_len = 0, words_cap = 0;
+    struct word_event *pair = NULL;
+    size_t num_pairs = 0, pairs_cap = 0;
+    char word[WORD_MAX];
+
+    /* Every word of every event */
+    for(long i = 0; i < count; i++){
+        const char *p = ev[i].summary;
+        int len;
+        while((len = next_word(&p, word)) > 0){
+            if(words_len + len+1 > words_cap){
+                words_cap = (words_cap) ? words_cap*2 : 4096;
+                words = realloc(words, words_cap);
+            }
+            memcpy(words + words_len, word, len+1);
+            if(num_pairs == pairs_cap){
+                pairs_cap = (pairs_cap) ? pairs_cap*2 : 1024;
+                pair = realloc(pair, pairs_cap*sizeof(*pair));
+            }
+            pair[num_pairs].word = (uint32_t)words_len;
+            pair[num_pairs].event = (uint32_t)i;
+            num_pairs++;
+            words_len += len+1;
+        }
+    }
+    if(num_pairs > 0)
+        qsort_r(pair, num_pairs, sizeof(*pair), compare_word_events, words);
+
+    /* Count distinct words, and the bytes of their words and postings */
+    uint32_t num_words = 0, num_events = (uint32_t)count;
+    size_t text = 0, postings = 0;
+    for(size_t i = 0; i < num_pairs; i++){
+        int new_word = (i == 0 || strcmp(words + pair[i].word, words + pair[i-1].word) != 0);
+        if(!new_word && pair[i].event == pair[i-1].event)
+            continue;
+        if(new_word){
+            num_words++;
+            text += strlen(words + pair[i].word)+1;
+        }
+        postings += 5;
+    }
+
+    size_t day_pos = WORDS_HEADER + num_words*sizeof(struct word_entry);
+    size_t text_pos = day_pos + (size_t)num_events*8;
+    size_t max_size = text_pos + text + postings;
+    unsigned char *index = calloc(max_size, 1);
+    struct word_entry *entry = (struct word_entry *)(index + WORDS_HEADER);
+    size_t pos = text_pos + text;
+    long w = -1;
+    uint32_t prev = 0;
+
+    memcpy(index, WORDS_MAGIC, 8);
+    memcpy(index+8, &num_words, 4);
+    memcpy(index+12, &num_events, 4);
+    for(long i = 0; i < count; i++){
+        uint32_t days[2] = {(uint32_t)(ev[i].start/MINUTES_PER_DAY), (uint32_t)((ev[i].end-1)/MINUTES_PER_DAY)};
+        memcpy(index + day_pos + (size_t)i*8, days, 8);
+    }
+    for(size_t i = 0; i < num_pairs; i++){
+        int new_word = (i == 0 || strcmp(words + pair[i].word, words + pair[i-1].word) != 0);
+        if(!new_word && pair[i].event == pair[i-1].event)
+            continue;
+        if(new_word){
+            size_t len = strlen(words + pair[i].word)+1;
+            w++;
+            entry[w].word = (uint32_t)text_pos;
+            entry[w].postings = (uint32_t)pos;
+            memcpy(index + text_pos, words + pair[i].word, len);
+            text_pos += len;
+            prev = 0;
+        }
+        uint32_t delta = pair[i].event - prev;
+        while(delta >= 0x80){
+            index[pos++] = (unsigned char)(delta | 0x80);
+            delta >>= 7;
+        }
+        index[pos++] = (unsigned char)delta;
+        prev = pair[i].event;
+        entry[w].count++;
+    }
+    free(words);
+    free(pair);
+    *size = pos;
+    return index;
+}
+
+/*  FUNCTION:   check_word_index
+ *  Brief:      Check that the header, entries and day table of an index lie inside it
+ *  Param:
+ *              index: word index
+ *              size: size of the index
+ *
+ *  Return:     1 if the index can be used, 0 otherwise.
+ */
+int check_word_index(const unsigned char *index, size_t size){
+    uint32_t num_words, num_events;
+    if(size < WORDS_HEADER || memcmp(index, WORDS_MAGIC, 8) != 0){
+        return 0;
+    }
+    memcpy(&num_words, index+8, 4);
+    memcpy(&num_events, index+12, 4);
+    return ((size - WORDS_HEADER)/sizeof(struct word_entry) >= num_words &&
+            (size - WORDS_HEADER - num_words*sizeof(struct word_entry))/8 >= num_events);
+}
+
+/*  FUNCTION:   word_events
+ *  Brief:      Look up the events holding a word
+ *  Param:
+ *              index: word index, see check_word_index
+ *              size: size of the index
+ *              word: lower cased word
+ *              events: set to the sorted event numbers (allocated, NULL if none)
+ *
+ *  Return:     Number of events, -1 if the index is malformed.
+ */
+long word_events(const unsigned char *index, size_t size, const char *word, uint32_t **events){
+    uint32_t num_words, num_events;
+    memcpy(&num_words, index+8, 4);
+    memcpy(&num_events, index+12, 4);
+    *events = NULL;
+    const struct word_entry *entry = (const struct word_entry *)(index + WORDS_HEADER);
+    long lo = 0, hi = num_words;
+    while(lo < hi){
+        long mid = (lo+hi)/2;
+        const struct word_entry *e = &entry[mid];
+        if(e->word >= size || !memchr(index + e->word, '\0', size - e->word)){
+            return -1;
+        }
+        int c = strcmp((const char *)index + e->word, word);
+        if(c == 0){
+            /* Every posting takes at least one byte */
+            if(e->postings > size || e->count > size - e->postings){
+                return -1;
+            }
+            const unsigned char *p = index + e->postings, *end = index + size;
+            uint32_t event = 0;
+            *events = malloc((e->count) ? e->count*sizeof(uint32_t) : 1);
+            for(uint32_t i = 0; i < e->count; i++){
+                uint32_t delta = 0;
+                int shift = 0;
+                while(p < end && (*p & 0x80) && shift < 28){
+                    delta |= (uint32_t)(*p++ & 0x7f) << shift;
+                    shift += 7;
+                }
+                if(p == end || (*p & 0x80) || delta + ((uint32_t)*p << shift) >= num_events - event){
+                    free(*events);
+                    *events = NULL;
+                    return -1;
+                }
+                delta |= (uint32_t)*p++ << shift;
+                event += delta;
+                (*events)[i] = event;
+            }
+            return e->count;
+        } else if(c < 0){
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+    return 0;
+}
+
+/*  FUNCTION:   grep_index
+ *  Brief:      Mark the days of a range with events holding every word of a term
+ *  Param:
+ *              index: word index
+ *              size: size of the index
+ *              term: words to search for
+ *              marks: marks of the range to set
+ *
+ *  Return:     0 on success, 1 if the index is malformed.
+ */
+int grep_index(const unsigned char *index, size_t size, const char *term, struct day_marks *marks){
+    char word[WORD_MAX];
+    uint32_t *match = NULL;
+    long num_match = 0;
+    int first = 1;
+
+    if(!check_word_index(index, size)){
+        return 1;
+    }
+    /* Intersect the posting lists of the words */
+    while(next_word(&term, word) > 0){
+        uint32_t *events;
+        long n = word_events(index, size, word, &events), k = 0;
+        if(n < 0){
+            free(match);
+            return 1;
+        }
+        if(first){
+            match = events;
+            num_match = n;
+            first = 0;
+            continue;
+        }
+        for(long i = 0, j = 0; i < num_match && j < n;){
+            if(match[i] < events[j]){
+                i++;
+            } else if(match[i] > events[j]){
+                j++;
+            } else {
+                match[k++] = match[i];
+                i++;
+                j++;
+            }
+        }
+        num_match = k;
+        free(events);
+    }
+    /* Then the days of the matching events */
+    uint32_t num_words;
+    memcpy(&num_words, index+8, 4);
+    const unsigned char *day_table = index + WORDS_HEADER + num_words*sizeof(struct word_entry);
+    for(long i = 0; i < num_match; i++){
+        uint32_t days[2];
+        memcpy(days, day_table + (size_t)match[i]*8, 8);
+        long d0 = (long)days[0] - marks->first_day, d1 = (long)days[1] - marks->first_day;
+        for(long d = (d0 > 0) ? d0 : 0; d <= d1 && d < marks->num_days; d++)
+            marks->mark[d] = 1;
+    }
+    free(match);
+    return 0;
+}
+
+
+/* Event store
+ *
+ * A store is an index file and an append-only log next to it (<file>.log)
+ * holding events in event file format. --store-add appends to the log. When
+ * the log grows past a quarter of the index (and STORE_LOG_MIN bytes) it is
+ * compacted: index and log are merged into a new index, which replaces the
+ * old one, and the log is emptied. Appends and compaction hold an exclusive
+ * flock on the log, readers a shared one, so lines appended during a
+ * compaction are not lost and readers never see a half compacted store.
+ *
+ * The index is read with mmap and laid out as:
+ *
+ *   struct store_header
+ *   struct store_block[num_blocks]
+ *   packed columns of every block, followed by 8 bytes of padding
+ *   summaries, NUL terminated, in event order
+ *
+ * Events are sorted by start and cut into blocks of up to STORE_BLOCK
+ * events. A block stores three bit-packed columns: the start day as the
+ * difference to the previous event's start day (0 for the first, whose day
+ * is in the block header), the start minute of the day and the duration.
+ * Each column uses as many bits as its largest value in the block needs,
+ * so a decade of hourly events takes a few bits per column and event.
+ *
+ * Finding the events of a range is two binary searches over the block
+ * headers and decoding the blocks between them. Events starting up to
+ * max_days before the range may reach into it, so the first search starts
+ * that far back.
+ */
+#define STORE_MAGIC "CALSTOR2"
+#define STORE_BLOCK 64
+#define STORE_LOG_MIN 65536
+#define STORE_MINUTE_BITS 11
+
+struct store_header {
+    char magic[8];
+    uint32_t num_events;
+    uint32_t num_blocks;
+    uint32_t max_days;      /* Most days between start and end of any event */
+    uint32_t reserved;
+    uint64_t summaries;     /* File offset of the summaries */
+};
+
+struct store_block {
+    uint32_t first_day;
+    uint32_t first_event;
+    uint32_t data;          /* Offset of the packed columns from the first block's */
+    uint32_t summary;       /* Offset of the first summary from the start of the summaries */
+    uint8_t day_bits;
+    uint8_t duration_bits;
+    uint16_t reserved;
+};
+
+/*  FUNCTION:   bits_needed
+ *  Brief:      Number of bits needed to store a value
+ */
+int bits_needed(unsigned long v){
+    return (v) ? 64 - __builtin_clzl(v) : 0;
+}
+
+/*  FUNCTION:   pack_bits
+ *  Brief:      Append values of a fixed bit width to a zeroed bit stream
+ *  Param:
+ *              buf: bit stream, little endian
+ *              pos: bit position to write at, advanced past the values
+ *              v: values
+ *              count: number of values
+ *              bits: width of a value (up to 32)
+ */
+void pack_bits(unsigned char *buf, size_t *pos, const uint32_t *v, int count, int bits){
+    for(int i = 0; i < count; i++, *pos += bits){
+        uint64_t x = (uint64_t)v[i] << (*pos%8);
+        for(size_t j = *pos/8; x; j++, x >>= 8){
+            buf[j] |= (unsigned char)x;
+        }
+    }
+}
+
+/*  FUNCTION:   unpack_bits
+ *  Brief:      Read values of a fixed bit width from a bit stream. The stream
+ *              must be followed by 8 readable bytes.
+ *  Param:
+ *              buf: bit stream, little endian
+ *              pos: bit position of the first value
+ *              v: set to the values
+ *              count: number of values
+ *              bits: width of a value (up to 32)
+ */
+void unpack_bits(const unsigned char *buf, size_t pos, uint32_t *v, int count, int bits){
+    uint64_t mask = ((uint64_t)1 << bits) - 1;
+    for(int i = 0; i < count; i++){
+        size_t p = pos + (size_t)i*bits;
+        uint64_t x;
+        memcpy(&x, buf + p/8, 8);
+        v[i] = (uint32_t)((x >> (p%8)) & mask);
+    }
+}
+
+/*  FUNCTION:   store_decode_block
+ *  Brief:      Decode the start and end times of the events of a block
+ *  Param:
+ *              data: packed columns of all blocks, followed by 8 bytes of padding
+ *              data_size: size of the packed columns without the padding
+ *              b: block header
+ *              count: number of events in the block
+ *              start: set to the start of each event
+ *              end: set to the end of each event
+ *
+ *  Return:     0 on success, 1 if the block's columns do not fit the store.
+ */
+int store_decode_block(const unsigned char *data, size_t data_size, const struct store_block *b, int count, long *start, long *end){
+    uint32_t day[STORE_BLOCK], minute[STORE_BLOCK], duration[STORE_BLOCK];
+    size_t bits = (size_t)count*(b->day_bits + STORE_MINUTE_BITS + b->duration_bits);
+    if(b->day_bits > 32 || b->duration_bits > 32 || b->data > data_size || (bits+7)/8 > data_size - b->data){
+        return 1;
+    }
+    data += b->data;
+    unpack_bits(data, 0, day, count, b->day_bits);
+    unpack_bits(data, (size_t)count*b->day_bits, minute, count, STORE_MINUTE_BITS);
+    unpack_bits(data, (size_t)count*(b->day_bits + STORE_MINUTE_BITS), duration, count, b->duration_bits);
+
+    long d = b->first_day;
+    for(int i = 0; i < count; i++){
+        d += day[i];
+        start[i] = d*MINUTES_PER_DAY + minute[i];
+    }
+    for(int i = 0; i < count; i++){
+        end[i] = start[i] + duration[i];
+    }
+    return 0;
+}
+
+/*  FUNCTION:   store_query
+ *  Brief:      Add the events of a store index overlapping a time range to a list
+ *  Param:
+ *              path: index file (a missing index is an empty store)
+ *              source: index of the store, stored in its events
+ *              from: start of the range (minutes since 01.01.01 00:00)
+ *              to: end of the range (exclusive)
+ *              list: list to add events to
+ *
+ *  Return:     0 on success, 1 if the index is malformed.
+ */
+int store_query(const char *path, int source, long from, long to, struct event_list *list){
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0){
+        return 0;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct store_header)){
+        close(fd);
+        return 1;
+    }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        return 1;
+    }
+    const struct store_header *h = (const void *)map;
+    const struct store_block *block = (const void *)(h+1);
+    const unsigned char *data = (const unsigned char *)(block + h->num_blocks);
+    const char *summaries = map + h->summaries;
+    const char *map_end = map + st.st_size;
+    /* The block headers and the padding after the columns lie before the
+     * summaries, and the last summary ends the file, so strlen stays inside */
+    if(memcmp(h->magic, STORE_MAGIC, 8) != 0 ||
+       h->num_blocks > (st.st_size - sizeof(*h))/sizeof(*block) ||
+       h->summaries > (uint64_t)st.st_size ||
+       h->summaries < sizeof(*h) + (uint64_t)h->num_blocks*sizeof(*block) + 8 ||
+       map_end[-1] != '\0'){
+        munmap((void *)map, st.st_size);
+        return 1;
+    }
+
+    /* Last block starting at or before the earliest start day that can reach the range */
+    long lo_day = from/MINUTES_PER_DAY - h->max_days;
+    long hi_day = (to-1)/MINUTES_PER_DAY;
+    long lo = 0, hi = h->num_blocks;
+    while(lo < hi){
+        long mid = (lo+hi)/2;
+        if((long)block[mid].first_day <= lo_day)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    long b0 = (lo > 0) ? lo-1 : 0;
+    /* First block starting after the range */
+    lo = b0;
+    hi = h->num_blocks;
+    while(lo < hi){
+        long mid = (lo+hi)/2;
+        if((long)block[mid].first_day <= hi_day)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    long b1 = lo;
+
+    for(long b = b0; b < b1; b++){
+        long start[STORE_BLOCK], end[STORE_BLOCK];
+        uint32_t end_event = (b+1 < (long)h->num_blocks) ? block[b+1].first_event : h->num_events;
+        if(end_event < block[b].first_event || end_event - block[b].first_event > STORE_BLOCK ||
+           end_event > h->num_events || block[b].summary >= (uint64_t)st.st_size - h->summaries){
+            munmap((void *)map, st.st_size);
+            return 1;
+        }
+        int count = (int)(end_event - block[b].first_event);
+        const char *summary = summaries + block[b].summary;
+
+        if(store_decode_block(data, summaries - 8 - (const char *)data, &block[b], count, start, end)){
+            munmap((void *)map, st.st_size);
+            return 1;
+        }
+        for(int i = 0; i < count; i++, summary += strlen(summary)+1){
+            if(summary >= map_end){
+                munmap((void *)map, st.st_size);
+                return 1;
+            }
+            if(end[i] <= from || start[i] >= to)
+                continue;
+            if(list->count == list->cap){
+                list->cap = (list->cap) ? list->cap*2 : 256;
+                list->ev = realloc(list->ev, list->cap*sizeof(*list->ev));
+            }
+            struct event e = {start[i], end[i], strdup(summary), source};
+            list->ev[list->count++] = e;
+        }
+    }
+    munmap((void *)map, st.st_size);
+    return 0;
+}
+
+/*  FUNCTION:   lock_store
+ *  Brief:      Lock the log of a store, see "Event store"
+ *  Param:
+ *              log_path: log of the store
+ *              exclusive: If set (to 1) lock exclusively, creating the log if
+ *                         needed, otherwise shared
+ *
+ *  Return:     Descriptor holding the lock (closing it unlocks), opened for
+ *              appending when exclusive. -1 if the log could not be opened or locked.
+ */
+int lock_store(const char *log_path, int exclusive){
+    int fd = open(log_path, (exclusive) ? O_WRONLY | O_APPEND | O_CREAT : O_RDONLY, 0644);
+    if(fd >= 0 && flock(fd, (exclusive) ? LOCK_EX : LOCK_SH) != 0){
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/*  FUNCTION:   read_store
+ *  Brief:      Add the events of a store (index and log) overlapping a time
+ *              range to a list. The caller holds the store's lock.
+ *  Param:
+ *              path: store index file, the log is <path>.log
+ *              source: index of the store, stored in its events
+ *              from: start of the range (minutes since 01.01.01 00:00)
+ *              to: end of the range (exclusive)
+ *              list: list to add events to
+ *
+ *  Return:     0 on success, 1 if the store is malformed.
+ */
+int read_store(const char *path, int source, long from, long to, struct event_list *list){
+    char log_path[strlen(path) + 5];
+    struct event_list log = {NULL, 0, 0};
+    if(store_query(path, source, from, to, list)){
+        fprintf(stderr, "Malformed store %s\n", path);
+        return 1;
+    }
+    sprintf(log_path, "%s.log", path);
+    if(access(log_path, R_OK) == 0 && load_events(log_path, source, &log) == 0){
+        for(long i = 0; i < log.count; i++){
+            if(log.ev[i].end <= from || log.ev[i].start >= to){
+                free(log.ev[i].summary);
+                continue;
+            }
+            if(list->count == list->cap){
+                list->cap = (list->cap) ? list->cap*2 : 256;
+                list->ev = realloc(list->ev, list->cap*sizeof(*list->ev));
+            }
+            list->ev[list->count++] = log.ev[i];
+        }
+        free(log.ev);
+    }
+    return 0;
+}
+
+/*  FUNCTION:   load_store
+ *  Brief:      Add the events of a store (index and log) overlapping a time range to a list
+ *  Param:
+ *              path: store index file, the log is <path>.log
+ *              source: index of the store, stored in its events
+ *              from: start of the range (minutes since 01.01.01 00:00)
+ *              to: end of the range (exclusive)
+ *              list: list to add events to
+ *
+ *  Return:     0 on success, 1 if the store is malformed.
+ */
+int load_store(const char *path, int source, long from, long to, struct event_list *list){
+    char log_path[strlen(path) + 5];
+    sprintf(log_path, "%s.log", path);
+    /* Without a log there is nothing a compaction could take away */
+    int fd = lock_store(log_path, 0);
+    int ret = read_store(path, source, from, to, list);
+    if(fd >= 0){
+        close(fd);
+    }
+    return ret;
+}
+
+/*  FUNCTION:   write_store
+ *  Brief:      Write sorted events as a store index
+ *  Return:     0 on success, 1 on write errors.
+ */
+int write_store(const char *path, const struct event_list *list){
+    struct store_header h;
+    uint32_t num_blocks = (uint32_t)((list->count + STORE_BLOCK-1)/STORE_BLOCK);
+    struct store_block *block = calloc(num_blocks+1, sizeof(*block));
+    /* Every column value takes at most 32 bits */
+    unsigned char *data = calloc((size_t)list->count*12 + 8, 1);
+    size_t pos = 0;
+    uint32_t summaries = 0;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, STORE_MAGIC, 8);
+    for(uint32_t b = 0; b < num_blocks; b++){
+        uint32_t day[STORE_BLOCK], minute[STORE_BLOCK], duration[STORE_BLOCK];
+        long first = (long)b*STORE_BLOCK;
+        int count = (list->count - first < STORE_BLOCK) ? (int)(list->count - first) : STORE_BLOCK;
+        long prev_day = list->ev[first].start/MINUTES_PER_DAY;
+        unsigned long day_max = 0, duration_max = 0;
+
+        for(int i = 0; i < count; i++){
+            const struct event *e = &list->ev[first+i];
+            long d = e->start/MINUTES_PER_DAY;
+            long days = (e->end-1)/MINUTES_PER_DAY - d;
+            day[i] = (uint32_t)(d - prev_day);
+            minute[i] = (uint32_t)(e->start%MINUTES_PER_DAY);
+            duration[i] = (uint32_t)(e->end - e->start);
+            prev_day = d;
+            day_max |= day[i];
+            duration_max |= duration[i];
+            if(days > h.max_days)
+                h.max_days = (uint32_t)days;
+        }
+        block[b].first_day = (uint32_t)(list->ev[first].start/MINUTES_PER_DAY);
+        block[b].first_event = (uint32_t)first;
+        block[b].data = (uint32_t)(pos/8);
+        block[b].summary = summaries;
+        block[b].day_bits = (uint8_t)bits_needed(day_max);
+        block[b].duration_bits = (uint8_t)bits_needed(duration_max);
+        pack_bits(data, &pos, day, count, block[b].day_bits);
+        pack_bits(data, &pos, minute, count, STORE_MINUTE_BITS);
+        pack_bits(data, &pos, duration, count, block[b].duration_bits);
+        /* Blocks start on whole bytes */
+        pos = (pos+7)/8*8;
+        for(int i = 0; i < count; i++){
+            summaries += strlen(list->ev[first+i].summary)+1;
+        }
+    }
+    h.num_events = (uint32_t)list->count;
+    h.num_blocks = num_blocks;
+    h.summaries = sizeof(h) + num_blocks*sizeof(*block) + pos/8 + 8;
+
+    FILE *out = fopen(path, "w");
+    int ret = 1;
+    if(out){
+        fwrite(&h, sizeof(h), 1, out);
+        fwrite(block, sizeof(*block), num_blocks, out);
+        fwrite(data, 1, pos/8 + 8, out);
+        for(long i = 0; i < list->count; i++){
+            fwrite(list->ev[i].summary, 1, strlen(list->ev[i].summary)+1, out);
+        }
+        ret = (fclose(out) != 0);
+    }
+    free(block);
+    free(data);
+    return ret;
+}
+
+/*  FUNCTION:   compact_store
+ *  Brief:      Merge the log of a store into its index and empty the log
+ *  Return:     0 on success, 1 on errors.
+ */
+int compact_store(const char *path){
+    struct event_list list = {NULL, 0, 0};
+    char tmp_path[strlen(path) + 5];
+    char log_path[strlen(path) + 5];
+    char words_path[strlen(path) + 7];
+    char words_tmp_path[strlen(path) + 11];
+    int ret = 1;
+
+    sprintf(tmp_path, "%s.tmp", path);
+    sprintf(log_path, "%s.log", path);
+    sprintf(words_path, "%s.words", path);
+    sprintf(words_tmp_path, "%s.words.tmp", path);
+    int fd = lock_store(log_path, 1);
+    if(fd >= 0 && read_store(path, 0, 0, LONG_MAX, &list) == 0){
+        qsort(list.ev, list.count, sizeof(*list.ev), compare_events);
+
+        /* Index the words of the summaries while they are at hand */
+        size_t size;
+        unsigned char *index = build_word_index(list.ev, list.count, &size);
+        FILE *words = fopen(words_tmp_path, "w");
+        int words_ok = (words && fwrite(index, 1, size, words) == size);
+        if(words && fclose(words) != 0){
+            words_ok = 0;
+        }
+        free(index);
+
+        /* Both files are complete before either replaces the old one. Appends
+           wait for the lock, so the log holds nothing that is not merged. */
+        if(words_ok && write_store(tmp_path, &list) == 0 && rename(tmp_path, path) == 0 &&
+           rename(words_tmp_path, words_path) == 0 && ftruncate(fd, 0) == 0){
+            ret = 0;
+        }
+        unlink(words_tmp_path);
+    }
+    if(fd >= 0){
+        close(fd);
+    }
+    if(ret){
+        fprintf(stderr, "Could not compact store %s\n", path);
+    }
+    free_events(&list);
+    return ret;
+}
+
+/*  FUNCTION:   append_store
+ *  Brief:      Append the valid event lines of stdin to the log of a store,
+ *              and compact the store once the log has grown large
+ *  Return:     0 on success, 1 on errors.
+ */
+int append_store(const char *path){
+    struct event_list list = {NULL, 0, 0};
+    char log_path[strlen(path) + 5];
+    struct stat index_st, log_st;
+
+    sprintf(log_path, "%s.log", path);
+    if(load_events("/dev/stdin", 0, &list)){
+        return 1;
+    }
+    int fd = lock_store(log_path, 1);
+    FILE *log = (fd >= 0) ? fdopen(fd, "a") : NULL;
+    if(!log){
+        fprintf(stderr, "Could not open %s for writing\n", log_path);
+        if(fd >= 0){
+            close(fd);
+        }
+        free_events(&list);
+        return 1;
+    }
+    for(long i = 0; i < list.count; i++){
+        char start[32], end[32];
+        format_time(start, sizeof(start), list.ev[i].start);
+        format_time(end, sizeof(end), list.ev[i].end);
+        fprintf(log, "%s %s %s\n", start, end, list.ev[i].summary);
+    }
+    free_events(&list);
+    /* Closing unlocks the log */
+    if(fclose(log) != 0){
+        return 1;
+    }
+
+    if(stat(log_path, &log_st) == 0 && log_st.st_size >= STORE_LOG_MIN){
+        if(stat(path, &index_st) != 0 || log_st.st_size*4 >= index_st.st_size){
+            return compact_store(path);
+        }
+    }
+    return 0;
+}
+
+
+/*  FUNCTION:   grep_events
+ *  Brief:      Mark the days on which the events of one file or store hold
+ *              every word of a term
+ *  Param:
+ *              term: words to search for
+ *              path: event file or store
+ *              is_store: If set (to 1) path is a store
+ *              events: the loaded events of the file
+ *              count: number of events
+ *              marks: marks of the searched range to set
+ */
+void grep_events(const char *term, const char *path, int is_store, const struct event *events, long count, struct day_marks *marks){
+    size_t size;
+    unsigned char *index;
+    if(is_store){
+        /* The compacted events through the stored index, the log directly */
+        char words_path[strlen(path) + 7];
+        char log_path[strlen(path) + 5];
+        struct event_list log = {NULL, 0, 0};
+        struct stat st;
+        int indexed = 0;
+        sprintf(words_path, "%s.words", path);
+        sprintf(log_path, "%s.log", path);
+        int lock = lock_store(log_path, 0);
+        int fd = open(words_path, O_RDONLY);
+        if(fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0){
+            const unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(map != MAP_FAILED){
+                indexed = (grep_index(map, st.st_size, term, marks) == 0);
+                munmap((void *)map, st.st_size);
+            }
+        }
+        if(fd >= 0){
+            close(fd);
+        }
+        if(indexed && access(log_path, R_OK) == 0 && load_events(log_path, 0, &log) == 0){
+            index = build_word_index(log.ev, log.count, &size);
+            grep_index(index, size, term, marks);
+            free(index);
+        }
+        free_events(&log);
+        if(lock >= 0){
+            close(lock);
+        }
+        if(indexed){
+            return;
+        }
+        /* Without a usable stored index search the loaded events */
+    }
+    index = build_word_index(events, count, &size);
+    grep_index(index, size, term, marks);
+    free(index);
+}
+
+
+/* Holidays
+ *
+ * Holiday lists hold one day or range of days per line, optionally followed
+ * by a description, e.g.
+ *
+ *   2024-12-25 Christmas Day
+ *   2024-07-15..2024-08-09 Company closure
+ *
+ * --compile-days turns a list into a day bitmap file, which --holidays maps
+ * into memory as it is, so looking a day up is reading one bit:
+ *
+ *   DAYS_MAGIC, 4 byte first day, 4 byte number of days (little endian),
+ *   one bit per day (lowest bit first)
+ *
+ * --holidays also reads lists directly, compiling them when loaded.
+ */
+#define DAYS_MAGIC "CALDAYS1"
+#define DAYS_HEADER 16
+
+/*  FUNCTION:   compile_day_list
+ *  Brief:      Read a holiday list into a day bitmap
+ *  Param:
+ *              path: holiday list
+ *
+ *  Return:     Bitmap (allocated), NULL if the file could not be opened.
+ *              Malformed lines are reported on stderr and skipped.
+ */
+struct day_bitmap *compile_day_list(const char *path){
+    FILE *in = fopen(path, "r");
+    char line[1024];
+    long *range = NULL, num_ranges = 0, cap = 0, first = -1, last = -1;
+    int line_no = 0;
+    if(!in){
+        fprintf(stderr, "Could not open %s for reading\n", path);
+        return NULL;
+    }
+    while(fgets(line, sizeof(line), in)){
+        char *tok = strtok(line, " \t\r\n"), *dots;
+        long t0, t1;
+        line_no++;
+        if(!tok || tok[0] == '#')
+            continue;
+        dots = strstr(tok, "..");
+        if(dots)
+            *dots = '\0';
+        if(!parse_time(tok, 0, &t0) || !parse_time((dots) ? dots+2 : tok, 0, &t1) || t1 < t0){
+            fprintf(stderr, "%s:%d: malformed day\n", path, line_no);
+            continue;
+        }
+        if(num_ranges*2 == cap){
+            cap = (cap) ? cap*2 : 128;
+            range = realloc(range, cap*sizeof(long));
+        }
+        range[num_ranges*2] = t0/MINUTES_PER_DAY;
+        range[num_ranges*2+1] = t1/MINUTES_PER_DAY;
+        if(first < 0 || range[num_ranges*2] < first)
+            first = range[num_ranges*2];
+        if(range[num_ranges*2+1] > last)
+            last = range[num_ranges*2+1];
+        num_ranges++;
+    }
+    fclose(in);
+
+    struct day_bitmap *days = calloc(1, sizeof(*days));
+    unsigned char *bits;
+    days->first_day = (first < 0) ? 0 : first;
+    days->num_days = (first < 0) ? 0 : last - first + 1;
+    bits = calloc((days->num_days+7)/8 + 1, 1);
+    for(long r = 0; r < num_ranges; r++){
+        for(long d = range[r*2]; d <= range[r*2+1]; d++){
+            long i = d - days->first_day;
+            bits[i >> 3] |= (unsigned char)(1 << (i & 7));
+        }
+    }
+    days->bits = bits;
+    free(range);
+    return days;
+}
+
+/*  FUNCTION:   compile_days
+ *  Brief:      Compile a holiday list into a day bitmap file
+ *  Return:     0 on success, 1 on errors.
+ */
+int compile_days(const char *in_path, const char *out_path){
+    struct day_bitmap *days = compile_day_list(in_path);
+    unsigned char header[DAYS_HEADER];
+    if(!days){
+        return 1;
+    }
+    FILE *out = fopen(out_path, "w");
+    if(!out){
+        fprintf(stderr, "Could not open %s for writing\n", out_path);
+        return 1;
+    }
+    memcpy(header, DAYS_MAGIC, 8);
+    for(int i = 0; i < 4; i++){
+        header[8+i] = (unsigned char)(days->first_day >> (i*8));
+        header[12+i] = (unsigned char)(days->num_days >> (i*8));
+    }
+    fwrite(header, 1, DAYS_HEADER, out);
+    fwrite(days->bits, 1, (days->num_days+7)/8, out);
+    return (fclose(out) != 0);
+}
+
+/*  FUNCTION:   load_holidays
+ *  Brief:      Map a compiled day bitmap file into memory, or compile a
+ *              holiday list
+ *  Return:     Bitmap, NULL on errors.
+ */
+struct day_bitmap *load_holidays(const char *path){
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0){
+        fprintf(stderr, "Could not open %s for reading\n", path);
+        return NULL;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size < DAYS_HEADER){
+        close(fd);
+        return compile_day_list(path);
+    }
+    const unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED || memcmp(map, DAYS_MAGIC, 8) != 0){
+        if(map != MAP_FAILED)
+            munmap((void *)map, st.st_size);
+        return compile_day_list(path);
+    }
+
+    /* The mapping stays for the rest of the run */
+    struct day_bitmap *days = calloc(1, sizeof(*days));
+    for(int i = 0; i < 4; i++){
+        days->first_day |= (long)map[8+i] << (i*8);
+        days->num_days |= (long)map[12+i] << (i*8);
+    }
+    days->bits = map + DAYS_HEADER;
+    if(DAYS_HEADER + (days->num_days+7)/8 > st.st_size){
+        fprintf(stderr, "Malformed day file %s\n", path);
+        return NULL;
+    }
+    return days;
+}
+
+
+/* Free/busy
+ *
+ * Every busy file belongs to one person. Workers load, sort and merge each
+ * person's events into disjoint busy intervals. The intervals of all people
+ * are then swept into a difference array over day numbers, giving the
+ * number of busy people per day.
+ */
+struct person {
+    const char *path;
+    long *busy;         /* Sorted, disjoint busy intervals as start/end pairs */
+    long num_busy;
+    int failed;
+};
+
+struct busy_job {
+    pthread_mutex_t lock;
+    struct person *person;
+    int num_persons;
+    int next;
+};
+
+/*  FUNCTION:   merge_busy
+ *  Brief:      Sort events and merge overlapping ones into busy intervals
+ *  Param:
+ *              p: person to set busy intervals for
+ *              list: the person's events
+ */
+void merge_busy(struct person *p, struct event_list *list){
+    qsort(list->ev, list->count, sizeof(*list->ev), compare_events);
+    p->busy = malloc((list->count ? list->count : 1)*2*sizeof(long));
+    p->num_busy = 0;
+    for(long i = 0; i < list->count; i++){
+        long *last = p->busy + (p->num_busy-1)*2;
+        if(p->num_busy > 0 && list->ev[i].start <= last[1]){
+            if(list->ev[i].end > last[1])
+                last[1] = list->ev[i].end;
+        } else {
+            p->busy[p->num_busy*2] = list->ev[i].start;
+            p->busy[p->num_busy*2+1] = list->ev[i].end;
+            p->num_busy++;
+        }
+    }
+}
+
+/*  FUNCTION:   busy_worker
+ *  Brief:      Worker thread. Loads and merges busy files until none are left.
+ *  Param:
+ *              arg: struct busy_job shared by the workers
+ */
+void *busy_worker(void *arg){
+    struct busy_job *job = arg;
+    for(;;){
+        pthread_mutex_lock(&job->lock);
+        int i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if(i >= job->num_persons){
+            return NULL;
+        }
+        struct person *p = &job->person[i];
+        struct event_list list = {NULL, 0, 0};
+        p->failed = load_events(p->path, i, &list);
+        merge_busy(p, &list);
+        free_events(&list);
+    }
+}
+
+/*  FUNCTION:   load_persons
+ *  Brief:      Load and merge the busy files of several people in parallel
+ *  Param:
+ *              paths: one busy file per person
+ *              num_persons: number of people
+ *
+ *  Return:     Array of people, or NULL if a file could not be read.
+ */
+struct person *load_persons(char **paths, int num_persons){
+    struct busy_job job;
+    long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_workers < 1)
+        num_workers = 1;
+    if(num_workers > num_persons)
+        num_workers = num_persons;
+    pthread_t workers[num_workers];
+
+    pthread_mutex_init(&job.lock, NULL);
+    job.person = calloc(num_persons, sizeof(*job.person));
+    job.num_persons = num_persons;
+    job.next = 0;
+    for(int i = 0; i < num_persons; i++){
+        job.person[i].path = paths[i];
+    }
+    long started = ring_start(workers, num_workers, busy_worker, &job);
+    /* Take part in the loading, which does all of it if no thread started */
+    busy_worker(&job);
+    for(long i = 0; i < started; i++){
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    for(int i = 0; i < num_persons; i++){
+        if(job.person[i].failed){
+            return NULL;
+        }
+    }
+    return job.person;
+}
+
+/*  FUNCTION:   count_busy
+ *  Brief:      Count the number of busy people per day
+ *  Param:
+ *              person: people with merged busy intervals
+ *              num_persons: number of people
+ *
+ *  Return:     Busy people per day, covering every day someone is busy.
+ */
+struct day_counts *count_busy(struct person *person, int num_persons){
+    struct day_counts *counts = calloc(1, sizeof(*counts));
+    long first = -1, last = -1;
+
+    for(int i = 0; i < num_persons; i++){
+        if(person[i].num_busy == 0)
+            continue;
+        long d0 = person[i].busy[0]/MINUTES_PER_DAY;
+        long d1 = (person[i].busy[person[i].num_busy*2-1]-1)/MINUTES_PER_DAY;
+        if(first < 0 || d0 < first)
+            first = d0;
+        if(d1 > last)
+            last = d1;
+    }
+    if(first < 0){
+        counts->count = calloc(1, sizeof(int));
+        return counts;
+    }
+
+    counts->first_day = first;
+    counts->num_days = last - first + 1;
+    counts->count = calloc(counts->num_days+1, sizeof(int));
+
+    /* Sweep: +1 on the first busy day of each run of days, -1 after its last.
+       A person with several intervals on one day is only counted once.
+    */
+    for(int i = 0; i < num_persons; i++){
+        long last_counted = -1;
+        for(long j = 0; j < person[i].num_busy; j++){
+            long d0 = person[i].busy[j*2]/MINUTES_PER_DAY - first;
+            long d1 = (person[i].busy[j*2+1]-1)/MINUTES_PER_DAY - first;
+            if(d0 <= last_counted)
+                d0 = last_counted+1;
+            if(d0 > d1)
+                continue;
+            counts->count[d0]++;
+            counts->count[d1+1]--;
+            last_counted = d1;
+        }
+    }
+    for(long d = 1; d < counts->num_days; d++){
+        counts->count[d] += counts->count[d-1];
+    }
+    return counts;
+}
+
+/* Meeting slots
+ *
+ * The busy intervals of all people are merged into one union stream with a
+ * heap holding each person's next interval, so only the intervals up to the
+ * last slot found are ever looked at. Free gaps of that stream inside working
+ * hours on business days (Monday to Friday) are the common free slots.
+ */
+struct slot_heap_entry {
+    long start;
+    long end;
+    int person;
+    long pos;
+};
+
+struct slot_finder {
+    struct person *person;
+    struct slot_heap_entry *heap;
+    int heap_len;
+    long union_start;   /* Current interval of the union stream */
+    long union_end;
+    int has_union;
+};
+
+/*  FUNCTION:   slot_heap_down
+ *  Brief:      Restore heap order below heap entry i
+ */
+void slot_heap_down(struct slot_finder *f, int i){
+    for(;;){
+        int min = i;
+        int l = i*2+1, r = i*2+2;
+        if(l < f->heap_len && f->heap[l].start < f->heap[min].start)
+            min = l;
+        if(r < f->heap_len && f->heap[r].start < f->heap[min].start)
+            min = r;
+        if(min == i)
+            return;
+        struct slot_heap_entry t = f->heap[i];
+        f->heap[i] = f->heap[min];
+        f->heap[min] = t;
+        i = min;
+    }
+}
+
+/*  FUNCTION:   slot_heap_pop
+ *  Brief:      Take the busy interval starting first and refill the heap
+ *              with the next interval of the same person
+ *  Return:     0 if the heap was empty, 1 otherwise
+ */
+int slot_heap_pop(struct slot_finder *f, long *start, long *end){
+    if(f->heap_len == 0)
+        return 0;
+    struct slot_heap_entry *top = &f->heap[0];
+    struct person *p = &f->person[top->person];
+    *start = top->start;
+    *end = top->end;
+    if(++top->pos < p->num_busy){
+        top->start = p->busy[top->pos*2];
+        top->end = p->busy[top->pos*2+1];
+    } else {
+        f->heap[0] = f->heap[--f->heap_len];
+    }
+    slot_heap_down(f, 0);
+    return 1;
+}
+
+/*  FUNCTION:   slot_union_next
+ *  Brief:      Advance the union stream to its next interval, merging
+ *              overlapping and touching busy intervals of all people
+ */
+void slot_union_next(struct slot_finder *f){
+    long start, end;
+    f->has_union = slot_heap_pop(f, &f->union_start, &f->union_end);
+    while(f->has_union && f->heap_len > 0 && f->heap[0].start <= f->union_end){
+        slot_heap_pop(f, &start, &end);
+        if(end > f->union_end)
+            f->union_end = end;
+    }
+}
+
+/*  FUNCTION:   find_slots
+ *  Brief:      Find the first common free slots of all people
+ *  Param:
+ *              person: people with merged busy intervals
+ *              num_persons: number of people
+ *              from: time (minutes since 01.01.01) to start searching at
+ *              duration: slot length in minutes
+ *              work_start: start of working hours (minutes after midnight)
+ *              work_end: end of working hours (minutes after midnight)
+ *              slot: set to the start time of each slot found
+ *              max_slots: number of slots to find
+ *
+ *  Return:     Number of slots found
+ */
+int find_slots(struct person *person, int num_persons, long from, long duration, long work_start, long work_end, long *slot, int max_slots){
+    struct slot_finder f;
+    int found = 0;
+
+    if(duration < 1 || duration > work_end - work_start)
+        return 0;
+
+    f.person = person;
+    f.heap = malloc((num_persons ? num_persons : 1)*sizeof(*f.heap));
+    f.heap_len = 0;
+    for(int i = 0; i < num_persons; i++){
+        /* Skip the intervals ending before the search starts */
+        long lo = 0, hi = person[i].num_busy;
+        while(lo < hi){
+            long mid = (lo+hi)/2;
+            if(person[i].busy[mid*2+1] <= from)
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+        if(lo < person[i].num_busy){
+            struct slot_heap_entry e = {person[i].busy[lo*2], person[i].busy[lo*2+1], i, lo};
+            f.heap[f.heap_len++] = e;
+        }
+    }
+    for(int i = f.heap_len/2-1; i >= 0; i--){
+        slot_heap_down(&f, i);
+    }
+    slot_union_next(&f);
+
+    for(long day = from/MINUTES_PER_DAY; found < max_slots; day++){
+        int dow = day_of_week(day);
+        if(dow == 0 || dow == 6)
+            continue;
+        long t = day*MINUTES_PER_DAY + work_start;
+        long window_end = day*MINUTES_PER_DAY + work_end;
+        if(t < from)
+            t = from;
+        while(t < window_end && found < max_slots){
+            while(f.has_union && f.union_end <= t){
+                slot_union_next(&f);
+            }
+            if(f.has_union && f.union_start <= t){
+                t = f.union_end;
+                continue;
+            }
+            long gap_end = (f.has_union && f.union_start < window_end) ? f.union_start : window_end;
+            if(gap_end - t >= duration){
+                slot[found++] = t;
+            }
+            t = gap_end;
+        }
+    }
+    free(f.heap);
+    return found;
+}
+
+/*  FUNCTION:   mark_slots
+ *  Brief:      Mark the days of the slots found for highlighting
+ */
+struct day_marks *mark_slots(long *slot, int num_slots){
+    struct day_marks *marks = calloc(1, sizeof(*marks));
+    if(num_slots == 0){
+        return marks;
+    }
+    marks->first_day = slot[0]/MINUTES_PER_DAY;
+    marks->num_days = slot[num_slots-1]/MINUTES_PER_DAY - marks->first_day + 1;
+    marks->mark = calloc(marks->num_days, 1);
+    for(int i = 0; i < num_slots; i++){
+        marks->mark[slot[i]/MINUTES_PER_DAY - marks->first_day] = 1;
+    }
+    return marks;
+}
+
+/*  FUNCTION:   merge_marks
+ *  Brief:      Combine two sets of marked days (either may be NULL).
+ *              Frees both and returns their union.
+ */
+struct day_marks *merge_marks(struct day_marks *a, struct day_marks *b){
+    if(!a || a->num_days == 0)
+        return b;
+    if(!b || b->num_days == 0)
+        return a;
+    struct day_marks *u = calloc(1, sizeof(*u));
+    long a_last = a->first_day + a->num_days, b_last = b->first_day + b->num_days;
+    u->first_day = (a->first_day < b->first_day) ? a->first_day : b->first_day;
+    u->num_days = ((a_last > b_last) ? a_last : b_last) - u->first_day;
+    u->mark = calloc(u->num_days, 1);
+    for(long i = 0; i < a->num_days; i++)
+        u->mark[a->first_day - u->first_day + i] |= a->mark[i];
+    for(long i = 0; i < b->num_days; i++)
+        u->mark[b->first_day - u->first_day + i] |= b->mark[i];
+    free(a->mark);
+    free(a);
+    free(b->mark);
+    free(b);
+    return u;
+}
+
+/*  FUNCTION:   print_slots
+ *  Brief:      Print a list of slots, e.g. "Tue 2024-03-05 09:00-09:30"
+ */
+void print_slots(FILE *fp, long *slot, int num_slots, long duration){
+    fprintf(fp, "\n");
+    for(int i = 0; i < num_slots; i++){
+        long day = slot[i]/MINUTES_PER_DAY;
+        long start = slot[i]%MINUTES_PER_DAY;
+        long end = start + duration;
+        int y, m, d;
+        day_to_date(day, &y, &m, &d);
+        fprintf(fp, "%s %04d-%02d-%02d %02ld:%02ld-%02ld:%02ld\n", weekday_abbr[day_of_week(day)], y, m+1, d, start/60, start%60, end/60, end%60);
+    }
+    if(num_slots == 0){
+        fprintf(fp, "No free slots\n");
+    }
+}
+
+/*  FUNCTION:   parse_hours
+ *  Brief:      Parse working hours written as 09:00-17:00
+ *  Return:     1 if str was valid working hours, 0 if it was not.
+ */
+int parse_hours(const char *str, long *start, long *end){
+    int h0, m0, h1, m1;
+    if(sscanf(str, "%d:%d-%d:%d", &h0, &m0, &h1, &m1) != 4 || h0 < 0 || m0 < 0 || m0 > 59 || m1 < 0 || m1 > 59 || h1 > 24){
+        return 0;
+    }
+    *start = h0*60 + m0;
+    *end = h1*60 + m1;
+    return *start < *end && *end <= MINUTES_PER_DAY;
+}
+
+/* Conflicts
+ *
+ * Events of all calendars are sorted by start and swept once, keeping every
+ * event that has not ended yet in an array sorted by end, latest first. Events
+ * that end before the next start drop off its tail, and the next event
+ * overlaps every event left in it. This lists every overlapping pair in
+ * O(n log n + pairs).
+ */
+struct conflict {
+    const struct event *first;
+    const struct event *second;
+    long start;     /* Overlapping time */
+    long end;
+};
+
+/*  FUNCTION:   find_conflicts
+ *  Brief:      Find overlapping events
+ *  Param:
+ *              list: events of all calendars (sorted by the call)
+ *              num_conflicts: set to number of conflicts found
+ *
+ *  Return:     Array of conflicts in order of time
+ */
+struct conflict *find_conflicts(struct event_list *list, long *num_conflicts){
+    struct conflict *conflict = NULL;
+    long count = 0, cap = 0;
+    const struct event **active = malloc((list->count ? list->count : 1)*sizeof(*active));
+    long num_active = 0;
+
+    qsort(list->ev, list->count, sizeof(*list->ev), compare_events);
+    for(long i = 0; i < list->count; i++){
+        const struct event *e = &list->ev[i];
+        while(num_active > 0 && active[num_active-1]->end <= e->start){
+            num_active--;
+        }
+        for(long j = 0; j < num_active; j++){
+            if(count == cap){
+                cap = (cap) ? cap*2 : 64;
+                conflict = realloc(conflict, cap*sizeof(*conflict));
+            }
+            conflict[count].first = active[j];
+            conflict[count].second = e;
+            conflict[count].start = e->start;
+            conflict[count].end = (e->end < active[j]->end) ? e->end : active[j]->end;
+            count++;
+        }
+        /* Insert e, keeping the array sorted by end */
+        long j = num_active++;
+        while(j > 0 && active[j-1]->end < e->end){
+            active[j] = active[j-1];
+            j--;
+        }
+        active[j] = e;
+    }
+    free(active);
+    *num_conflicts = count;
+    return conflict;
+}
+
+/*  FUNCTION:   mark_conflicts
+ *  Brief:      Mark every day with overlapping events for highlighting
+ */
+struct day_marks *mark_conflicts(struct conflict *conflict, long num_conflicts){
+    struct day_marks *marks = calloc(1, sizeof(*marks));
+    long first = -1, last = -1;
+    for(long i = 0; i < num_conflicts; i++){
+        long d1 = (conflict[i].end-1)/MINUTES_PER_DAY;
+        if(first < 0)
+            first = conflict[i].start/MINUTES_PER_DAY;
+        if(d1 > last)
+            last = d1;
+    }
+    if(first < 0){
+        return marks;
+    }
+    marks->first_day = first;
+    marks->num_days = last - first + 1;
+    marks->mark = calloc(marks->num_days, 1);
+    for(long i = 0; i < num_conflicts; i++){
+        long d1 = (conflict[i].end-1)/MINUTES_PER_DAY;
+        for(long d = conflict[i].start/MINUTES_PER_DAY; d <= d1; d++){
+            marks->mark[d-first] = 1;
+        }
+    }
+    return marks;
+}
+
+/*  FUNCTION:   print_time
+ *  Brief:      Print a time as "Tue 2024-03-05 09:00"
+ *  Param:
+ *              fp: stream to print to
+ *              t: minutes since 01.01.01 00:00
+ */
+void print_time(FILE *fp, long t){
+    long day = t/MINUTES_PER_DAY;
+    long minute = t%MINUTES_PER_DAY;
+    int y, m, d;
+    day_to_date(day, &y, &m, &d);
+    fprintf(fp, "%s %04d-%02d-%02d %02ld:%02ld", weekday_abbr[day_of_week(day)], y, m+1, d, minute/60, minute%60);
+}
+
+/*  FUNCTION:   print_conflicts
+ *  Brief:      Print a list of conflicts with the overlapping time and both events
+ */
+void print_conflicts(FILE *fp, struct conflict *conflict, long num_conflicts, char **paths){
+    fprintf(fp, "\n");
+    for(long i = 0; i < num_conflicts; i++){
+        print_time(fp, conflict[i].start);
+        fprintf(fp, " - ");
+        print_time(fp, conflict[i].end);
+        fprintf(fp, "  %s (%s) overlaps %s (%s)\n", conflict[i].second->summary, paths[conflict[i].second->source], conflict[i].first->summary, paths[conflict[i].first->source]);
+    }
+    if(num_conflicts == 0){
+        fprintf(fp, "No conflicts\n");
+    }
+}
+
+/* Recurrence rules
+ *
+ * Rule files hold one repeating event per line:
+ *
+ *   <frequency>[/<interval>] <start> <end> <summary>
+ *
+ * where frequency is daily, weekly, monthly or yearly, and start and end are
+ * the first occurrence, written as in event files. Monthly and yearly rules
+ * skip months without the start day (e.g. the 31st or February 29th).
+ */
+enum frequency {DAILY, WEEKLY, MONTHLY, YEARLY};
+const char *frequency_name[4] = {"daily", "weekly", "monthly", "yearly"};
+
+struct rule {
+    enum frequency freq;
+    int interval;
+    long start;         /* First occurrence */
+    long duration;
+    char *summary;
+};
+
+struct rule_list {
+    struct rule *rule;
+    int count;
+};
+
+/*  FUNCTION:   load_rules
+ *  Brief:      Read a rule file and add its rules to a list.
+ *              Malformed lines are reported on stderr and skipped.
+ *
+ *  Return:     0 on success, 1 if the file could not be opened.
+ */
+int load_rules(const char *path, struct rule_list *list){
+    FILE *in = fopen(path, "r");
+    char line[1024];
+    int line_number = 0;
+    if(!in){
+        fprintf(stderr, "Could not open %s for reading\n", path);
+        return 1;
+    }
+    while(fgets(line, sizeof(line), in)){
+        char freq[32], start[64], end[64];
+        int summary = 0, f = -1;
+        long end_time;
+        struct rule r;
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0] == '\0' || line[0] == '#'){
+            continue;
+        }
+        if(sscanf(line, "%31s %63s %63s %n", freq, start, end, &summary) == 3){
+            char *slash = strchr(freq, '/');
+            r.interval = 1;
+            if(slash){
+                r.interval = atoi(slash+1);
+                *slash = '\0';
+            }
+            for(int i = 0; i < 4; i++){
+                if(strcmp(freq, frequency_name[i]) == 0)
+                    f = i;
+            }
+        }
+        if(f < 0 || r.interval < 1 || !parse_time(start, 0, &r.start) || !parse_time(end, 1, &end_time) || end_time <= r.start){
+            fprintf(stderr, "%s:%d: malformed rule\n", path, line_number);
+            continue;
+        }
+        if(summary == 0){
+            summary = strlen(line);
+        }
+        r.freq = f;
+        r.duration = end_time - r.start;
+        r.summary = strdup(line + summary);
+        list->rule = realloc(list->rule, (list->count+1)*sizeof(*list->rule));
+        list->rule[list->count++] = r;
+    }
+    fclose(in);
+    return 0;
+}
+
+/*  FUNCTION:   rule_occurrence
+ *  Brief:      Calculate the start of occurrence k of a rule
+ *  Param:
+ *              r: rule
+ *              k: occurrence (0 is the first)
+ *
+ *  Return:     Start (minutes since 01.01.01 00:00), or -1 if occurrence k
+ *              falls on a day its month does not have.
+ */
+long rule_occurrence(const struct rule *r, long k){
+    long day = r->start/MINUTES_PER_DAY;
+    long minute = r->start%MINUTES_PER_DAY;
+    if(r->freq == DAILY || r->freq == WEEKLY){
+        long period = (r->freq == DAILY) ? 1 : 7;
+        return r->start + k*r->interval*period*MINUTES_PER_DAY;
+    }
+    int y, m, d;
+    day_to_date(day, &y, &m, &d);
+    long months = y*12L + m + k*r->interval*((r->freq == MONTHLY) ? 1 : 12);
+    y = (int)(months/12);
+    m = (int)(months%12);
+    if(d > num_days[is_leap_year(y)][m])
+        return -1;
+    return day_number(y, m, d)*MINUTES_PER_DAY + minute;
+}
+
+/*  FUNCTION:   rule_first_after
+ *  Brief:      Find the first occurrence of a rule that ends after a time,
+ *              by jumping straight to it instead of stepping from the start
+ *
+ *  Return:     Occurrence number
+ */
+long rule_first_after(const struct rule *r, long t){
+    long k = 0;
+    if(t > r->start + r->duration){
+        long step;
+        if(r->freq == DAILY)
+            step = MINUTES_PER_DAY;
+        else if(r->freq == WEEKLY)
+            step = 7L*MINUTES_PER_DAY;
+        else if(r->freq == MONTHLY)
+            step = 31L*MINUTES_PER_DAY;
+        else
+            step = 366L*MINUTES_PER_DAY;
+        /* Lower bound, months and years are at most 31 and 366 days */
+        k = (t - r->start - r->duration)/(step*r->interval);
+    }
+    for(;;){
+        long start = rule_occurrence(r, k);
+        if(start >= 0 && start + r->duration > t)
+            return k;
+        k++;
+    }
+}
+
+
+/* Agenda
+ *
+ * Every source is a stream producing events in order of start:
+ *  - an event file keeps only its num earliest upcoming events, selected with
+ *    a bounded heap, so the file is never sorted as a whole
+ *  - a rule produces its occurrences one at a time
+ * The streams are merged with a heap holding the next event of each stream,
+ * and merging stops after num events.
+ */
+struct agenda_stream {
+    struct event *ev;           /* Event file: selected events, in order */
+    long count;
+    long pos;
+    const struct rule *rule;    /* Rule: next occurrence k */
+    long k;
+    struct event next;          /* Next event of the stream */
+};
+
+/*  FUNCTION:   agenda_stream_advance
+ *  Brief:      Move a stream to its next event
+ *  Return:     0 if the stream is exhausted, 1 otherwise
+ */
+int agenda_stream_advance(struct agenda_stream *s){
+    if(s->rule){
+        long start;
+        while((start = rule_occurrence(s->rule, s->k++)) < 0)
+            ;
+        s->next.start = start;
+        s->next.end = start + s->rule->duration;
+        s->next.summary = s->rule->summary;
+        return 1;
+    }
+    if(s->pos == s->count)
+        return 0;
+    s->next = s->ev[s->pos++];
+    return 1;
+}
+
+/*  FUNCTION:   event_heap_down
+ *  Brief:      Restore order below entry i of a heap of events, ordered by
+ *              start (dir 1: earliest on top, dir -1: latest on top)
+ */
+void event_heap_down(struct event *heap, long len, long i, int dir){
+    for(;;){
+        long top = i;
+        long l = i*2+1, r = i*2+2;
+        if(l < len && dir*compare_events(&heap[l], &heap[top]) < 0)
+            top = l;
+        if(r < len && dir*compare_events(&heap[r], &heap[top]) < 0)
+            top = r;
+        if(top == i)
+            return;
+        struct event t = heap[i];
+        heap[i] = heap[top];
+        heap[top] = t;
+        i = top;
+    }
+}
+
+/*  FUNCTION:   select_upcoming
+ *  Brief:      Select the num earliest events ending after a time, in order
+ *  Param:
+ *              ev: events (not changed)
+ *              count: number of events
+ *              from: time the events must end after
+ *              num: number of events to select
+ *              selected: set to the selected events
+ *
+ *  Return:     Number of selected events
+ */
+long select_upcoming(const struct event *ev, long count, long from, long num, struct event *selected){
+    long len = 0;
+    /* Max heap of the num earliest events seen so far */
+    for(long i = 0; i < count; i++){
+        if(ev[i].end <= from)
+            continue;
+        if(len < num){
+            selected[len++] = ev[i];
+            for(long j = len/2-1; len == num && j >= 0; j--)
+                event_heap_down(selected, len, j, -1);
+        } else if(compare_events(&ev[i], &selected[0]) < 0){
+            selected[0] = ev[i];
+            event_heap_down(selected, len, 0, -1);
+        }
+    }
+    if(len < num){
+        for(long j = len/2-1; j >= 0; j--)
+            event_heap_down(selected, len, j, -1);
+    }
+    /* Heap sort into ascending order */
+    for(long end = len-1; end > 0; end--){
+        struct event t = selected[0];
+        selected[0] = selected[end];
+        selected[end] = t;
+        event_heap_down(selected, end, 0, -1);
+    }
+    return len;
+}
+
+/*  FUNCTION:   print_agenda
+ *  Brief:      Print the next num events of all sources in chronological order
+ *  Param:
+ *              fp: stream to print to
+ *              events: events of all event files, file by file
+ *              file_start: index of the first event of each file, num_files+1 entries
+ *              num_files: number of event files
+ *              rules: recurrence rules
+ *              from: time (minutes since 01.01.01) events must end after
+ *              num: number of events to print
+ */
+void print_agenda(FILE *fp, const struct event_list *events, const long *file_start, int num_files, const struct rule_list *rules, long from, long num){
+    int num_streams = num_files + rules->count;
+    struct agenda_stream stream[num_streams ? num_streams : 1];
+    /* Heap of the next event of each stream, source holds the stream index */
+    struct event heap[num_streams ? num_streams : 1];
+    long len = 0;
+
+    for(int i = 0; i < num_files; i++){
+        struct agenda_stream *s = &stream[i];
+        memset(s, 0, sizeof(*s));
+        s->ev = malloc((num ? num : 1)*sizeof(*s->ev));
+        s->count = select_upcoming(events->ev + file_start[i], file_start[i+1] - file_start[i], from, num, s->ev);
+    }
+    for(int i = 0; i < rules->count; i++){
+        struct agenda_stream *s = &stream[num_files + i];
+        memset(s, 0, sizeof(*s));
+        s->rule = &rules->rule[i];
+        s->k = rule_first_after(s->rule, from);
+    }
+    for(int i = 0; i < num_streams; i++){
+        if(agenda_stream_advance(&stream[i])){
+            heap[len] = stream[i].next;
+            heap[len].source = i;
+            len++;
+        }
+    }
+    for(long j = len/2-1; j >= 0; j--)
+        event_heap_down(heap, len, j, 1);
+
+    for(long printed = 0; printed < num && len > 0; printed++){
+        struct event e = heap[0];
+        print_time(fp, e.start);
+        if(e.end/MINUTES_PER_DAY == e.start/MINUTES_PER_DAY){
+            fprintf(fp, "-%02ld:%02ld", (e.end%MINUTES_PER_DAY)/60, e.end%60);
+        } else {
+            fprintf(fp, " - ");
+            print_time(fp, e.end);
+        }
+        fprintf(fp, "  %s\n", e.summary);
+
+        struct agenda_stream *s = &stream[e.source];
+        if(agenda_stream_advance(s)){
+            heap[0] = s->next;
+            heap[0].source = e.source;
+        } else {
+            heap[0] = heap[--len];
+        }
+        event_heap_down(heap, len, 0, 1);
+    }
+
+    for(int i = 0; i < num_files; i++){
+        free(stream[i].ev);
+    }
+}
+
+/* Week view
+ *
+ * One column per day (Sunday to Saturday) and one row per hour. The empty
+ * grid is laid out once into a template buffer and cached. Each week copies
+ * the template, writes its dates into the heading and the events into their
+ * cells, and is printed with a single write.
+ *
+ * An event shows its summary in its first hour of each day and "|" in the
+ * following hours. A cell holding more than one event ends with "+".
+ */
+#define WEEK_LABEL 5        /* "09:00" */
+#define WEEK_CELL 11        /* Space and 10 characters of content */
+#define WEEK_LINE (WEEK_LABEL + 7*WEEK_CELL + 1)
+
+struct week_template {
+    int first_hour;
+    int last_hour;          /* Exclusive */
+    char *buf;              /* Heading line followed by one line per hour */
+    size_t len;
+};
+
+/*  FUNCTION:   week_template
+ *  Brief:      Get the empty week grid for a range of hours, laying it out
+ *              only when the range differs from the cached one
+ */
+struct week_template *week_template(int first_hour, int last_hour){
+    static struct week_template t = {-1, -1, NULL, 0};
+    if(t.buf && t.first_hour == first_hour && t.last_hour == last_hour){
+        return &t;
+    }
+    int rows = 1 + last_hour - first_hour;
+    t.first_hour = first_hour;
+    t.last_hour = last_hour;
+    t.len = rows*WEEK_LINE;
+    t.buf = realloc(t.buf, t.len);
+    memset(t.buf, ' ', t.len);
+    for(int r = 0; r < rows; r++){
+        char *line = t.buf + r*WEEK_LINE;
+        line[WEEK_LINE-1] = '\n';
+        for(int d = 0; d < 7; d++){
+            char *cell = line + WEEK_LABEL + d*WEEK_CELL + 1;
+            if(r == 0){
+                memcpy(cell, day_names + d*3, 2);
+            } else {
+                cell[0] = '.';
+            }
+        }
+        if(r > 0){
+            int h = first_hour + r-1;
+            line[0] = '0' + h/10;
+            line[1] = '0' + h%10;
+            memcpy(line+2, ":00", 3);
+        }
+    }
+    return &t;
+}
+
+/*  FUNCTION:   week_place
+ *  Brief:      Place an event into the cells of a week grid it overlaps
+ *  Param:
+ *              buf: week grid (copy of the template)
+ *              used: set for the cells holding an event, [day][row]
+ *              week_start: time the week starts (Sunday 00:00)
+ *              first_hour: first hour shown
+ *              last_hour: last hour shown (exclusive)
+ *              start: event start (minutes since 01.01.01 00:00)
+ *              end: event end (exclusive)
+ *              summary: event summary
+ */
+void week_place(char *buf, unsigned char used[7][24], long week_start, int first_hour, int last_hour, long start, long end, const char *summary){
+    for(int d = 0; d < 7; d++){
+        int first = 1;
+        for(int h = first_hour; h < last_hour; h++){
+            long slot = week_start + d*MINUTES_PER_DAY + h*60;
+            if(end <= slot || start >= slot + 60)
+                continue;
+            int row = 1 + h - first_hour;
+            char *cell = buf + row*WEEK_LINE + WEEK_LABEL + d*WEEK_CELL + 1;
+            if(!used[d][row-1]){
+                used[d][row-1] = 1;
+                memset(cell, ' ', WEEK_CELL-1);
+                if(first){
+                    size_t len = strlen(summary);
+                    if(len > WEEK_CELL-1){
+                        /* Cut before a UTF-8 continuation byte, not inside a character */
+                        len = WEEK_CELL-1;
+                        while(len > 0 && ((unsigned char)summary[len] & 0xc0) == 0x80)
+                            len--;
+                    }
+                    memcpy(cell, summary, len);
+                } else {
+                    cell[0] = '|';
+                }
+            } else {
+                cell[WEEK_CELL-2] = '+';
+            }
+            first = 0;
+        }
+    }
+}
+
+/*  FUNCTION:   print_week
+ *  Brief:      Print the week (Sunday to Saturday) containing a day with
+ *              an hour grid and the events placed into it
+ *  Param:
+ *              fp: stream to print to
+ *              day: day number of any day in the week
+ *              first_hour: first hour to show
+ *              last_hour: last hour to show (exclusive)
+ *              events: events to place
+ *              rules: recurrence rules to place
+ */
+void print_week(FILE *fp, long day, int first_hour, int last_hour, const struct event_list *events, const struct rule_list *rules){
+    struct week_template *t = week_template(first_hour, last_hour);
+    long first_day = day - day_of_week(day);
+    long week_start = first_day*MINUTES_PER_DAY;
+    long week_end = week_start + 7L*MINUTES_PER_DAY;
+    unsigned char used[7][24];
+    char buf[t->len];
+
+    memcpy(buf, t->buf, t->len);
+    memset(used, 0, sizeof(used));
+
+    /* Dates in heading */
+    for(int d = 0; d < 7; d++){
+        int y, m, dd;
+        char *date = buf + WEEK_LABEL + d*WEEK_CELL + 4;
+        day_to_date(first_day + d, &y, &m, &dd);
+        date[0] = '0' + (m+1)/10;
+        date[1] = '0' + (m+1)%10;
+        date[2] = '-';
+        date[3] = '0' + dd/10;
+        date[4] = '0' + dd%10;
+    }
+
+    for(long i = 0; i < events->count; i++){
+        const struct event *e = &events->ev[i];
+        if(e->end > week_start && e->start < week_end)
+            week_place(buf, used, week_start, first_hour, last_hour, e->start, e->end, e->summary);
+    }
+    for(int i = 0; i < rules->count; i++){
+        const struct rule *r = &rules->rule[i];
+        for(long k = rule_first_after(r, week_start); ; k++){
+            long start = rule_occurrence(r, k);
+            if(start < 0)
+                continue;
+            if(start >= week_end)
+                break;
+            week_place(buf, used, week_start, first_hour, last_hour, start, start + r->duration, r->summary);
+        }
+    }
+
+    fwrite(buf, 1, t->len, fp);
+}
+
+/* Cron
+ *
+ * Cron expressions have five fields: minute, hour, day of month, month and
+ * day of week, each "*", a number, a range "a-b", a step "*\/n" or "a-b/n",
+ * or a comma separated list of those. Months and days of week may be given
+ * by name (jan, mon). Day of week 7 is Sunday. @yearly, @monthly, @weekly,
+ * @daily and @hourly are accepted too. When both day fields are restricted,
+ * a day matches if either does.
+ *
+ * Every field is kept as a bit set. The next fire time is found by jumping
+ * over whole months, then taking the lowest day in the month's bit set of
+ * matching days (built from month_start_day and num_days), then the lowest
+ * matching hour and minute, without stepping through minutes.
+ */
+struct cron {
+    unsigned long long minute;  /* Bit i set if minute i matches */
+    unsigned int hour;
+    unsigned int dom;           /* Bits 1-31 */
+    unsigned int month;         /* Bits 0-11 */
+    unsigned int dow;           /* Bits 0-6, 0=Sunday */
+    int dom_any;                /* Day field starts with "*" */
+    int dow_any;
+    char expr[5*64];
+    char *command;              /* Rest of a crontab line, or "" */
+};
+
+const char *cron_month_names[] = {"jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec", NULL};
+const char *cron_dow_names[] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat", NULL};
+
+/* Days 1, 8, 15, 22 and 29 of a month */
+#define CRON_WEEKLY_DAYS ((1ULL << 1) | (1ULL << 8) | (1ULL << 15) | (1ULL << 22) | (1ULL << 29))
+
+/*  FUNCTION:   cron_value
+ *  Brief:      Parse a number or a name of a cron field
+ *  Return:     Pointer past the value, or NULL if there was no value
+ */
+const char *cron_value(const char *str, int base, const char **names, int *value){
+    if(*str >= '0' && *str <= '9'){
+        *value = (int)strtol(str, (char **)&str, 10);
+        return str;
+    }
+    for(int i = 0; names && names[i]; i++){
+        if(strncasecmp(str, names[i], 3) == 0){
+            *value = base + i;
+            return str+3;
+        }
+    }
+    return NULL;
+}
+
+/*  FUNCTION:   parse_cron_field
+ *  Brief:      Parse one cron field into a bit set
+ *  Param:
+ *              field: field to parse
+ *              min: lowest value of the field
+ *              max: highest value of the field
+ *              names: names of the values from min, or NULL
+ *              bits: set to the values the field matches
+ *
+ *  Return:     1 if the field was valid, 0 if it was not.
+ */
+int parse_cron_field(const char *field, int min, int max, const char **names, unsigned long long *bits){
+    *bits = 0;
+    while(*field){
+        int lo = min, hi = max, step = 1;
+        if(*field == '*'){
+            field++;
+        } else {
+            if(!(field = cron_value(field, min, names, &lo)))
+                return 0;
+            hi = lo;
+            if(*field == '-' && !(field = cron_value(field+1, min, names, &hi)))
+                return 0;
+        }
+        if(*field == '/'){
+            step = (int)strtol(field+1, (char **)&field, 10);
+            if(step < 1)
+                return 0;
+            /* "5/15" means from 5 to the end */
+            if(lo == hi)
+                hi = max;
+        }
+        if(lo < min || hi > max || lo > hi)
+            return 0;
+        for(int v = lo; v <= hi; v += step){
+            *bits |= 1ULL << v;
+        }
+        if(*field == ',')
+            field++;
+        else if(*field)
+            return 0;
+    }
+    return 1;
+}
+
+/*  FUNCTION:   parse_cron
+ *  Brief:      Parse a cron expression, or a crontab line (expression followed by a command)
+ *  Return:     1 if the expression was valid, 0 if it was not.
+ */
+int parse_cron(const char *line, struct cron *c){
+    static const char *shortcuts[][2] = {
+        {"@yearly", "0 0 1 1 *"}, {"@annually", "0 0 1 1 *"}, {"@monthly", "0 0 1 * *"},
+        {"@weekly", "0 0 * * 0"}, {"@daily", "0 0 * * *"}, {"@midnight", "0 0 * * *"}, {"@hourly", "0 * * * *"}
+    };
+    char field[5][64];
+    char expanded[1024];
+    int rest = 0;
+    unsigned long long bits;
+
+    for(size_t i = 0; i < sizeof(shortcuts)/sizeof(shortcuts[0]); i++){
+        size_t len = strlen(shortcuts[i][0]);
+        if(strncmp(line, shortcuts[i][0], len) == 0 && (line[len] == '\0' || line[len] == ' ' || line[len] == '\t')){
+            snprintf(expanded, sizeof(expanded), "%s%s", shortcuts[i][1], line+len);
+            line = expanded;
+            break;
+        }
+    }
+    if(sscanf(line, "%63s %63s %63s %63s %63s %n", field[0], field[1], field[2], field[3], field[4], &rest) < 5){
+        return 0;
+    }
+    if(rest == 0){
+        rest = strlen(line);
+    }
+
+    if(!parse_cron_field(field[0], 0, 59, NULL, &c->minute))
+        return 0;
+    if(!parse_cron_field(field[1], 0, 23, NULL, &bits))
+        return 0;
+    c->hour = (unsigned int)bits;
+    if(!parse_cron_field(field[2], 1, 31, NULL, &bits))
+        return 0;
+    c->dom = (unsigned int)bits;
+    if(!parse_cron_field(field[3], 1, 12, cron_month_names, &bits))
+        return 0;
+    c->month = (unsigned int)(bits >> 1);
+    if(!parse_cron_field(field[4], 0, 7, cron_dow_names, &bits))
+        return 0;
+    c->dow = (unsigned int)((bits | bits >> 7) & 0x7f);
+    c->dom_any = (field[2][0] == '*');
+    c->dow_any = (field[4][0] == '*');
+    snprintf(c->expr, sizeof(c->expr), "%s %s %s %s %s", field[0], field[1], field[2], field[3], field[4]);
+    c->command = strdup(line + rest);
+    return 1;
+}
+
+/*  FUNCTION:   cron_days
+ *  Brief:      Calculate the days of a month a cron expression fires on
+ *  Return:     Bit set where bit d is set if day d (starting at 1) matches
+ */
+unsigned int cron_days(const struct cron *c, int y, int m){
+    int len = num_days[is_leap_year(y)][m];
+    unsigned long long valid = ((1ULL << len) - 1) << 1;
+    unsigned long long dow_days = 0;
+    int start = month_start_day(y, m);
+    for(int k = 0; k < 7; k++){
+        if(c->dow >> k & 1)
+            dow_days |= CRON_WEEKLY_DAYS << ((k - start + 7)%7);
+    }
+    /* As in cron, a day field starting with "*" (even with a step) narrows the other one */
+    unsigned long long days;
+    if(c->dom_any || c->dow_any)
+        days = c->dom & dow_days;
+    else
+        days = c->dom | dow_days;
+    return (unsigned int)(days & valid);
+}
+
+/*  FUNCTION:   cron_minute
+ *  Brief:      Find the first minute of a day, at or after a given minute,
+ *              that a cron expression fires on
+ *  Return:     Minutes after midnight, or -1 if there is none
+ */
+int cron_minute(const struct cron *c, int minute){
+    int mi = minute%60;
+    for(int h = minute/60; h < 24; h++, mi = 0){
+        if(!(c->hour >> h & 1))
+            continue;
+        unsigned long long mask = c->minute >> mi << mi;
+        if(mask)
+            return h*60 + __builtin_ctzll(mask);
+    }
+    return -1;
+}
+
+/*  FUNCTION:   cron_next
+ *  Brief:      Find the next time a cron expression fires
+ *  Param:
+ *              c: cron expression
+ *              t: earliest time (minutes since 01.01.01 00:00)
+ *
+ *  Return:     First fire time at or after t, or -1 if it never fires
+ *              (e.g. February 30th). The calendar repeats every 400 years,
+ *              so no more than that is searched.
+ */
+long cron_next(const struct cron *c, long t){
+    long day = t/MINUTES_PER_DAY;
+    int minute = (int)(t%MINUTES_PER_DAY);
+    int y, m, d;
+    day_to_date(day, &y, &m, &d);
+    for(int i = 0; i <= 400*12; i++){
+        if(c->month >> m & 1){
+            unsigned int days = cron_days(c, y, m) >> d << d;
+            while(days){
+                int dd = __builtin_ctz(days);
+                if(dd != d)
+                    minute = 0;
+                int fire = cron_minute(c, minute);
+                if(fire >= 0)
+                    return day_number(y, m, dd)*MINUTES_PER_DAY + fire;
+                days &= days-1;
+                d = dd+1;
+                minute = 0;
+            }
+        }
+        if(++m == 12){
+            m = 0;
+            y++;
+        }
+        d = 1;
+        minute = 0;
+    }
+    return -1;
+}
+
+/*  FUNCTION:   load_crontab
+ *  Brief:      Read the jobs of a crontab file. Comments, empty lines and
+ *              variable assignments are skipped, malformed lines reported on stderr.
+ *  Return:     0 on success, 1 if the file could not be opened.
+ */
+int load_crontab(const char *path, struct cron **cron, int *num_cron){
+    FILE *in = fopen(path, "r");
+    char line[1024];
+    int line_number = 0;
+    if(!in){
+        fprintf(stderr, "Could not open %s for reading\n", path);
+        return 1;
+    }
+    while(fgets(line, sizeof(line), in)){
+        char *start = line + strspn(line, " \t");
+        struct cron c;
+        line_number++;
+        start[strcspn(start, "\r\n")] = '\0';
+        if(start[0] == '\0' || start[0] == '#' || (start[0] != '@' && strchr(start, '=') && strcspn(start, "=") < strcspn(start, " \t"))){
+            continue;
+        }
+        if(!parse_cron(start, &c)){
+            fprintf(stderr, "%s:%d: malformed cron expression\n", path, line_number);
+            continue;
+        }
+        *cron = realloc(*cron, (*num_cron+1)*sizeof(**cron));
+        (*cron)[(*num_cron)++] = c;
+    }
+    fclose(in);
+    return 0;
+}
+
+/*  FUNCTION:   mark_cron
+ *  Brief:      Mark the days in a range a cron expression fires on
+ */
+struct day_marks *mark_cron(const struct cron *c, long first, long last){
+    struct day_marks *marks = calloc(1, sizeof(*marks));
+    marks->first_day = first;
+    marks->num_days = last - first + 1;
+    marks->mark = calloc(marks->num_days, 1);
+    long t = first*MINUTES_PER_DAY;
+    while((t = cron_next(c, t)) >= 0 && t/MINUTES_PER_DAY <= last){
+        marks->mark[t/MINUTES_PER_DAY - first] = 1;
+        /* Jump to the next day */
+        t = (t/MINUTES_PER_DAY + 1)*MINUTES_PER_DAY;
+    }
+    return marks;
+}
+
+/*  FUNCTION:   print_cron
+ *  Brief:      Print the next fire times of cron expressions
+ *  Param:
+ *              fp: stream to print to
+ *              cron: cron expressions
+ *              num_cron: number of expressions
+ *              from: time to start at (minutes since 01.01.01 00:00)
+ *              num: number of fire times per expression
+ */
+void print_cron(FILE *fp, const struct cron *cron, int num_cron, long from, int num){
+    for(int i = 0; i < num_cron; i++){
+        long t = from;
+        fprintf(fp, "\n%s", cron[i].expr);
+        if(cron[i].command[0]){
+            fprintf(fp, "  %s", cron[i].command);
+        }
+        fprintf(fp, "\n");
+        for(int j = 0; j < num; j++){
+            if((t = cron_next(&cron[i], t)) < 0){
+                if(j == 0)
+                    fprintf(fp, "  Never fires\n");
+                break;
+            }
+            fprintf(fp, "  ");
+            print_time(fp, t);
+            fprintf(fp, "\n");
+            t++;
+        }
+    }
+}
+
+/* iCalendar export
+ *
+ * --ics writes everything that falls into the printed months as one
+ * iCalendar stream instead of printing them: the events of --events and
+ * --store files, the occurrences of --rules, --holidays (one all day event
+ * per run of days) and every fire time of --cron and --crontab jobs.
+ *
+ * Events are formatted straight into an output buffer. Dates and times are
+ * copied from a table of two digit pairs, and the date of the last day
+ * written is kept, since consecutive events mostly share their day. Times
+ * are floating local times, as in event files.
+ */
+#define ICS_BUF (1 << 16)
+
+const char digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+struct ics_writer {
+    FILE *fp;
+    size_t len;
+    unsigned long uid;
+    long day;               /* Day of date, -1 before the first */
+    char date[8];           /* YYYYMMDD */
+    char stamp[16];         /* DTSTAMP, YYYYMMDDTHHMMSSZ */
+    char buf[ICS_BUF];
+};
+
+/*  FUNCTION:   ics_put
+ *  Brief:      Add bytes to the output buffer
+ */
+void ics_put(struct ics_writer *w, const char *s, size_t len){
+    if(w->len + len > ICS_BUF){
+        fwrite(w->buf, 1, w->len, w->fp);
+        w->len = 0;
+    }
+    memcpy(w->buf + w->len, s, len);
+    w->len += len;
+}
+
+/*  FUNCTION:   ics_put_pair
+ *  Brief:      Write a number from 0 to 99 as two digits
+ */
+void ics_put_pair(char *p, int v){
+    memcpy(p, digit_pairs + v*2, 2);
+}
+
+/*  FUNCTION:   ics_put_date
+ *  Brief:      Add a day as YYYYMMDD
+ */
+void ics_put_date(struct ics_writer *w, long day){
+    if(day != w->day){
+        int y, m, d;
+        day_to_date(day, &y, &m, &d);
+        ics_put_pair(w->date, (y/100)%100);
+        ics_put_pair(w->date+2, y%100);
+        ics_put_pair(w->date+4, m+1);
+        ics_put_pair(w->date+6, d);
+        w->day = day;
+    }
+    ics_put(w, w->date, 8);
+}
+
+/*  FUNCTION:   ics_put_time
+ *  Brief:      Add a property holding a time, e.g. DTSTART:20240305T090000
+ *              or, for whole days, DTSTART;VALUE=DATE:20240305
+ */
+void ics_put_time(struct ics_writer *w, const char *name, long t, int all_day){
+    char hhmm[9] = "T000000\r\n";
+    ics_put(w, name, strlen(name));
+    if(all_day){
+        ics_put(w, ";VALUE=DATE:", 12);
+        ics_put_date(w, t/MINUTES_PER_DAY);
+        ics_put(w, "\r\n", 2);
+        return;
+    }
+    ics_put(w, ":", 1);
+    ics_put_date(w, t/MINUTES_PER_DAY);
+    ics_put_pair(hhmm+1, (int)((t%MINUTES_PER_DAY)/60));
+    ics_put_pair(hhmm+3, (int)(t%60));
+    ics_put(w, hhmm, 9);
+}
+
+/*  FUNCTION:   ics_put_text
+ *  Brief:      Add a SUMMARY property, escaped and folded into lines of at
+ *              most 75 bytes (never inside a UTF-8 character). Bytes that do
+ *              not form a valid UTF-8 sequence count as characters of their own.
+ */
+void ics_put_text(struct ics_writer *w, const char *text){
+    char line[3*75];
+    int len = 8, pos = 8;
+    memcpy(line, "SUMMARY:", 8);
+    for(const unsigned char *p = (const unsigned char *)text; *p;){
+        char esc = (*p == '\\' || *p == ';' || *p == ',') ? (char)*p : (*p == '\n') ? 'n' : 0;
+        /* Bytes of this character: a lead byte only counts with all its continuation bytes */
+        int need = (esc) ? 2 : (*p >= 0xf8) ? 1 : (*p >= 0xf0) ? 4 : (*p >= 0xe0) ? 3 : (*p >= 0xc0) ? 2 : 1;
+        for(int i = 1; !esc && i < need; i++){
+            if((p[i] & 0xc0) != 0x80){
+                need = 1;
+                break;
+            }
+        }
+        if(len + need > 75){
+            ics_put(w, line, pos);
+            ics_put(w, "\r\n ", 3);
+            pos = 0;
+            len = 1;
+        }
+        assert(pos + need <= (int)sizeof(line));
+        if(esc){
+            line[pos++] = '\\';
+            line[pos++] = esc;
+            p++;
+        } else {
+            memcpy(line + pos, p, need);
+            pos += need;
+            p += need;
+        }
+        len += need;
+    }
+    ics_put(w, line, pos);
+    ics_put(w, "\r\n", 2);
+}
+
+/*  FUNCTION:   ics_event
+ *  Brief:      Add a VEVENT
+ *  Param:
+ *              w: writer
+ *              start: start (minutes since 01.01.01 00:00)
+ *              end: end, or -1 for an event without duration
+ *              all_day: If set (to 1) start and end are whole days
+ *              summary: summary
+ */
+void ics_event(struct ics_writer *w, long start, long end, int all_day, const char *summary){
+    char uid[24];
+    int n = 0;
+    unsigned long id = ++w->uid;
+    ics_put(w, "BEGIN:VEVENT\r\nUID:", 18);
+    do {
+        uid[sizeof(uid) - ++n] = (char)('0' + id%10);
+        id /= 10;
+    } while(id);
+    ics_put(w, uid + sizeof(uid) - n, n);
+    ics_put(w, "-", 1);
+    ics_put(w, w->stamp, 16);
+    ics_put(w, "@calendar\r\nDTSTAMP:", 19);
+    ics_put(w, w->stamp, 16);
+    ics_put(w, "\r\n", 2);
+    ics_put_time(w, "DTSTART", start, all_day);
+    if(end >= 0){
+        ics_put_time(w, "DTEND", end, all_day);
+    }
+    ics_put_text(w, summary);
+    ics_put(w, "END:VEVENT\r\n", 12);
+}
+
+/*  FUNCTION:   export_ics
+ *  Brief:      Write the events, rule occurrences, holidays and cron fire
+ *              times of a range of days as iCalendar
+ *  Param:
+ *              fp: stream to write to
+ *              first: first day (day number)
+ *              last: last day
+ *              events: events of --events and --store files
+ *              rules: recurrence rules
+ *              cron: cron expressions
+ *              num_cron: number of cron expressions
+ */
+void export_ics(FILE *fp, long first, long last, const struct event_list *events, const struct rule_list *rules, const struct cron *cron, int num_cron){
+    struct ics_writer *w = malloc(sizeof(*w));
+    long from = first*MINUTES_PER_DAY, to = (last+1)*MINUTES_PER_DAY;
+    time_t now = time(NULL);
+    struct tm utc;
+
+    w->fp = fp;
+    w->len = 0;
+    w->uid = 0;
+    w->day = -1;
+    gmtime_r(&now, &utc);
+    strftime(w->stamp, sizeof(w->stamp), "%Y%m%dT%H%M%S", &utc);
+    w->stamp[15] = 'Z';
+    ics_put(w, "BEGIN:VCALENDAR\r\nVERSION:2.0\r\nPRODID:-//Calendar//calendar.c//EN\r\n", 66);
+
+    for(long i = 0; i < events->count; i++){
+        const struct event *e = &events->ev[i];
+        if(e->end > from && e->start < to)
+            ics_event(w, e->start, e->end, 0, e->summary);
+    }
+
+    for(int i = 0; i < rules->count; i++){
+        const struct rule *r = &rules->rule[i];
+        for(long k = rule_first_after(r, from);; k++){
+            long start = rule_occurrence(r, k);
+            if(start >= to)
+                break;
+            if(start >= 0)
+                ics_event(w, start, start + r->duration, 0, r->summary);
+        }
+    }
+
+    if(holidays){
+        for(long d = first; d <= last; d++){
+            long i = d - holidays->first_day, run = d;
+            while(i >= 0 && i < holidays->num_days && run <= last && (holidays->bits[i >> 3] >> (i & 7)) & 1){
+                run++;
+                i++;
+            }
+            if(run > d){
+                ics_event(w, d*MINUTES_PER_DAY, run*MINUTES_PER_DAY, 1, "Holiday");
+                d = run;
+            }
+        }
+    }
+
+    /* Every fire time, month by month from the days each month matches */
+    for(int i = 0; i < num_cron; i++){
+        const struct cron *c = &cron[i];
+        const char *summary = (c->command[0]) ? c->command : c->expr;
+        int y, m, d;
+        day_to_date(first, &y, &m, &d);
+        for(long month_start = first - (d-1); month_start <= last; month_start += num_days[is_leap_year(y)][m], m = (m+1)%12, y += (m == 0)){
+            unsigned int days = (c->month >> m & 1) ? cron_days(c, y, m) : 0;
+            for(; days; days &= days-1){
+                long day = month_start + __builtin_ctz(days) - 1;
+                if(day < first || day > last)
+                    continue;
+                for(int minute = cron_minute(c, 0); minute >= 0; minute = (minute < MINUTES_PER_DAY-1) ? cron_minute(c, minute+1) : -1){
+                    ics_event(w, day*MINUTES_PER_DAY + minute, -1, 0, summary);
+                }
+            }
+        }
+    }
+
+    ics_put(w, "END:VCALENDAR\r\n", 15);
+    fwrite(w->buf, 1, w->len, fp);
+    free(w);
+}
+
+
+/*  FUNCTION:   mark_fiscal
+ *  Brief:      Mark the first day of every fiscal period in a range
+ */
+struct day_marks *mark_fiscal(long first, long last){
+    struct day_marks *marks = calloc(1, sizeof(*marks));
+    struct fiscal_year fy;
+    marks->first_day = first;
+    marks->num_days = last - first + 1;
+    marks->mark = calloc(marks->num_days, 1);
+    for(fiscal_year_of(first, &fy); fy.period[0] <= last; fiscal_year(fy.year+1, &fy)){
+        for(int p = 0; p < 12; p++){
+            if(fy.period[p] >= first && fy.period[p] <= last)
+                marks->mark[fy.period[p] - first] = 1;
+        }
+    }
+    return marks;
+}
+
+/*  FUNCTION:   print_fiscal
+ *  Brief:      List the fiscal periods overlapping a range, e.g.
+ *              "FY2025 P1   2024-02-04 - 2024-03-02  4 weeks"
+ */
+void print_fiscal(FILE *fp, long first, long last){
+    struct fiscal_year fy;
+    fprintf(fp, "\n");
+    for(fiscal_year_of(first, &fy); fy.period[0] <= last; fiscal_year(fy.year+1, &fy)){
+        for(int p = 0; p < 12; p++){
+            int y0, m0, d0, y1, m1, d1;
+            if(fy.period[p+1] <= first || fy.period[p] > last)
+                continue;
+            /* Periods starting before 0001-01-01, and the first one of fiscal
+               year 1 (which holds the days before it), are listed from 0001-01-01 */
+            day_to_date((fy.period[p] < 0 || (fy.year == 1 && p == 0)) ? 0 : fy.period[p], &y0, &m0, &d0);
+            day_to_date(fy.period[p+1]-1, &y1, &m1, &d1);
+            fprintf(fp, "FY%d P%-2d  %04d-%02d-%02d - %04d-%02d-%02d  %ld weeks\n", fy.year, p+1, y0, m0+1, d0, y1, m1+1, d1, (fy.period[p+1] - fy.period[p])/7);
+        }
+    }
+}
+
+/* Watch mode
+ *
+ * With --watch the printed months are kept on screen and re-rendered when an
+ * --events or --store file changes. Files are watched through inotify on
+ * their directories, so editors that replace a file by renaming are seen too.
+ *
+ * Only the changed file is parsed again. The printed view is split into its
+ * rows of months (the calls to print_calendar), and every row is rendered
+ * once into a cache. A change compares the old and new highlighted days and
+ * renders only the rows holding days that changed; all other rows are
+ * printed from the cache. The date is looked up again at every change and at
+ * least every WATCH_DATE_CHECK ms, and all rows are rendered again once it
+ * moves on, so the highlighted day follows midnight.
+ */
+#define WATCH_DATE_CHECK 60000
+
+struct grid_row {
+    int y, m, n;            /* First month and number of months in the row */
+    long first, last;       /* Day numbers of the row */
+    char *text;             /* Rendered row, NULL if it must be rendered */
+    size_t len;
+};
+
+struct grid_view {
+    int year;               /* Year of a whole year view, 0 for a month stream */
+    int w, s;
+    int num_rows;
+    struct grid_row *row;
+};
+
+struct watched_file {
+    const char *path;
+    const char *name;       /* Name within its directory */
+    int wd;
+    int is_store;
+    struct event_list events;
+};
+
+/*  FUNCTION:   grid_view_init
+ *  Brief:      Split the months printed by main and run into rows
+ *  Param:
+ *              view: view to set up
+ *              y, m, n, w: -y, -m, -n and -w (as given)
+ *              from_y, from_m, to_y, to_m: --from and --to (months < 0 if not given)
+ *
+ *  Return:     0 on success, 1 if the range is empty.
+ */
+int grid_view_init(struct grid_view *view, int y, int m, int n, int w, int from_y, int from_m, int to_y, int to_m){
+    int *date = get_current_date();
+    view->year = 0;
+    view->w = w;
+    if(from_m >= 0 || to_m >= 0){
+        if(from_m < 0){
+            from_y = date[2];
+            from_m = date[1];
+        }
+        y = from_y;
+        m = from_m;
+        n = (int)month_span(from_y, from_m, to_y, to_m, n);
+    } else if((y > 0 && m < 0) || n == 12){
+        view->year = (y > 0) ? y : date[2];
+        y = view->year;
+        m = 0;
+        n = 12;
+    } else {
+        y = (y > 0) ? y : date[2];
+        m = (m >= 0) ? m : date[1];
+        n = (n > 0) ? n : 1;
+    }
+    if(n < 1){
+        return 1;
+    }
+    view->s = (!view->year && (n == 1 || m+n > 12)) ? 1 : 0;
+    view->num_rows = (n+2)/3;
+    view->row = calloc(view->num_rows, sizeof(*view->row));
+    for(int i = 0; i < view->num_rows; i++){
+        struct grid_row *r = &view->row[i];
+        long last_month;
+        r->y = y + (m + i*3)/12;
+        r->m = (m + i*3)%12;
+        r->n = (n - i*3 < 3) ? n - i*3 : 3;
+        last_month = (long)r->y*12 + r->m + r->n-1;
+        r->first = day_number(r->y, r->m, 1);
+        r->last = day_number(last_month/12, last_month%12, num_days[is_leap_year(last_month/12)][last_month%12]);
+    }
+    return 0;
+}
+
+/*  FUNCTION:   print_grid_view
+ *  Brief:      Print a view like print_months or print_year, rendering only
+ *              the rows missing from the cache
+ */
+void print_grid_view(FILE *fp, struct grid_view *view){
+    if(view->year){
+        print_year_heading(fp, view->year, view->w);
+    }
+    for(int i = 0; i < view->num_rows; i++){
+        struct grid_row *r = &view->row[i];
+        if(!r->text){
+            FILE *mem = open_memstream(&r->text, &r->len);
+            print_calendar(mem, r->y, r->m, r->n, view->w, view->s);
+            fclose(mem);
+        }
+        if(!view->year && view->num_rows > 1){
+            fprintf(fp, "\n");
+        }
+        fwrite(r->text, 1, r->len, fp);
+        if(view->year){
+            fprintf(fp, "\n");
+        }
+    }
+}
+
+/*  FUNCTION:   is_marked
+ *  Brief:      Check if a day is marked
+ */
+int is_marked(const struct day_marks *marks, long day){
+    long i = (marks) ? day - marks->first_day : -1;
+    return i >= 0 && i < marks->num_days && marks->mark[i];
+}
+
+/*  FUNCTION:   copy_marks
+ *  Brief:      Copy marks (so they can be merged, which frees them)
+ */
+struct day_marks *copy_marks(const struct day_marks *a){
+    struct day_marks *copy = calloc(1, sizeof(*copy));
+    if(a && a->num_days > 0){
+        copy->first_day = a->first_day;
+        copy->num_days = a->num_days;
+        copy->mark = malloc(a->num_days);
+        memcpy(copy->mark, a->mark, a->num_days);
+    }
+    return copy;
+}
+
+/*  FUNCTION:   invalidate_rows
+ *  Brief:      Drop the cached rows holding days whose highlighting changed
+ *  Param:
+ *              view: view with its row cache
+ *              old: marks the cached rows were rendered with
+ *              marks: new marks
+ *              new_day: If set (to 1) the date changed and every row is dropped
+ *
+ *  Return:     Number of rows dropped.
+ */
+int invalidate_rows(struct grid_view *view, const struct day_marks *old, const struct day_marks *marks, int new_day){
+    int dropped = 0;
+    for(int i = 0; i < view->num_rows; i++){
+        struct grid_row *r = &view->row[i];
+        for(long d = r->first; r->text && d <= r->last; d++){
+            if(new_day || is_marked(old, d) != is_marked(marks, d)){
+                free(r->text);
+                r->text = NULL;
+                dropped++;
+            }
+        }
+    }
+    return dropped;
+}
+
+/*  FUNCTION:   load_watched
+ *  Brief:      (Re)load the events of one watched file
+ *  Return:     0 on success, 1 if the file could not be read.
+ */
+int load_watched(struct watched_file *f, int source, long first, long last){
+    struct event_list list = {NULL, 0, 0};
+    int ret = (f->is_store) ? load_store(f->path, source, first*MINUTES_PER_DAY, (last+1)*MINUTES_PER_DAY, &list) : load_events(f->path, source, &list);
+    if(ret){
+        free_events(&list);
+        return 1;
+    }
+    free_events(&f->events);
+    f->events = list;
+    return 0;
+}
+
+/*  FUNCTION:   render_watched
+ *  Brief:      Highlight the events of all watched files (or their conflicts,
+ *              or the ones matching --grep), drop the rows that changed and
+ *              print the view
+ *  Param:
+ *              fp: stream to print to
+ *              view: view with its row cache
+ *              file: watched files
+ *              num_files: number of watched files
+ *              paths: their paths, indexed by source
+ *              base: marks that do not come from events (slots, cron)
+ *              conflicts: If set (to 1) highlight and list conflicts only
+ *              grep: words of --grep, NULL to highlight all events
+ *              new_day: If set (to 1) the date changed since the last render
+ *
+ *  Return:     Number of rows rendered again.
+ */
+int render_watched(FILE *fp, struct grid_view *view, struct watched_file *file, int num_files, char **paths, const struct day_marks *base, int conflicts, const char *grep, int new_day){
+    struct event_list all = {NULL, 0, 0};
+    struct day_marks *old = day_marks;
+    struct conflict *conflict = NULL;
+    long num_conflicts = 0;
+    int dropped;
+
+    /* The events stay owned by their files */
+    for(int i = 0; i < num_files; i++){
+        all.count += file[i].events.count;
+    }
+    all.ev = malloc((all.count+1)*sizeof(*all.ev));
+    all.count = 0;
+    for(int i = 0; i < num_files; i++){
+        memcpy(all.ev + all.count, file[i].events.ev, file[i].events.count*sizeof(*all.ev));
+        all.count += file[i].events.count;
+    }
+
+    day_marks = copy_marks(base);
+    if(conflicts){
+        conflict = find_conflicts(&all, &num_conflicts);
+        day_marks = merge_marks(day_marks, mark_conflicts(conflict, num_conflicts));
+    } else if(grep){
+        struct day_marks *found = calloc(1, sizeof(*found));
+        found->first_day = view->row[0].first;
+        found->num_days = view->row[view->num_rows-1].last - found->first_day + 1;
+        found->mark = calloc(found->num_days, 1);
+        for(int i = 0; i < num_files; i++){
+            grep_events(grep, file[i].path, file[i].is_store, file[i].events.ev, file[i].events.count, found);
+        }
+        day_marks = merge_marks(day_marks, found);
+    } else if(all.count > 0){
+        day_marks = merge_marks(day_marks, mark_events(&all, view->row[0].first, view->row[view->num_rows-1].last));
+    }
+    dropped = invalidate_rows(view, old, day_marks, new_day);
+    if(old){
+        free(old->mark);
+        free(old);
+    }
+
+    if(isatty(fileno(fp))){
+        fprintf(fp, "\033[H\033[2J");
+    }
+    print_grid_view(fp, view);
+    if(conflicts){
+        print_conflicts(fp, conflict, num_conflicts, paths);
+    }
+    fflush(fp);
+    free(conflict);
+    free(all.ev);
+    return dropped;
+}
+
+/*  FUNCTION:   watch_events
+ *  Brief:      Print a view and print it again whenever one of its event
+ *              files changes, until interrupted
+ *  Param:
+ *              fp: stream to print to
+ *              view: view to print
+ *              paths: --events and --store files
+ *              is_store: which of them are stores
+ *              num_paths: number of files
+ *              conflicts: If set (to 1) highlight and list conflicts only
+ *              grep: words of --grep, NULL to highlight all events
+ *
+ *  Return:     1 on errors (it does not return otherwise).
+ */
+int watch_events(FILE *fp, struct grid_view *view, char **paths, int *is_store, int num_paths, int conflicts, const char *grep){
+    struct watched_file file[num_paths];
+    struct day_marks *base = day_marks;
+    long first = view->row[0].first, last = view->row[view->num_rows-1].last;
+    int fd = inotify_init1(IN_CLOEXEC);
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    if(fd < 0){
+        fprintf(stderr, "Could not watch files\n");
+        return 1;
+    }
+    day_marks = NULL;
+    for(int i = 0; i < num_paths; i++){
+        const char *slash = strrchr(paths[i], '/');
+        char dir[strlen(paths[i]) + 2];
+        if(slash){
+            snprintf(dir, (size_t)(slash - paths[i]) + 2, "%s", paths[i]);
+        } else {
+            strcpy(dir, ".");
+        }
+        file[i].path = paths[i];
+        file[i].name = (slash) ? slash+1 : paths[i];
+        file[i].is_store = is_store[i];
+        file[i].events = (struct event_list){NULL, 0, 0};
+        file[i].wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+        if(file[i].wd < 0){
+            fprintf(stderr, "Could not watch %s\n", paths[i]);
+            return 1;
+        }
+        if(load_watched(&file[i], i, first, last)){
+            return 1;
+        }
+    }
+    render_watched(fp, view, file, num_paths, paths, base, conflicts, grep, refresh_current_date());
+
+    for(;;){
+        int changed[num_paths];
+        int any = 0;
+        memset(changed, 0, sizeof(changed));
+
+        /* Collect the burst of events an editor causes before loading */
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int timeout = WATCH_DATE_CHECK;
+        while(poll(&pfd, 1, timeout) > 0){
+            ssize_t len = read(fd, buf, sizeof(buf));
+            if(len <= 0){
+                return 1;
+            }
+            for(char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len){
+                const struct inotify_event *e = (const struct inotify_event *)p;
+                for(int i = 0; e->len && i < num_paths; i++){
+                    size_t name_len = strlen(file[i].name);
+                    if(e->wd != file[i].wd || strncmp(e->name, file[i].name, name_len) != 0)
+                        continue;
+                    /* A store also changes through its log */
+                    if(e->name[name_len] == '\0' || (file[i].is_store && strcmp(e->name + name_len, ".log") == 0)){
+                        changed[i] = 1;
+                        any = 1;
+                    }
+                }
+            }
+            timeout = 50;
+        }
+        int new_day = refresh_current_date();
+        if(!any && !new_day){
+            continue;
+        }
+        for(int i = 0; i < num_paths; i++){
+            if(changed[i] && load_watched(&file[i], i, first, last)){
+                /* Keep the old events of files that are mid-write or gone */
+                fprintf(stderr, "Keeping previous events of %s\n", paths[i]);
+            }
+        }
+        render_watched(fp, view, file, num_paths, paths, base, conflicts, grep, new_day);
+    }
+}
+
+
+/* Date queries
+ *
+ * Subcommands answering one question about dates without printing a
+ * calendar, each in constant time from the day number of a date:
+ *
+ *   dow <date>                weekday, e.g. Tue
+ *   doy <date>                day of year, 1-366
+ *   week <date>               ISO 8601 week, e.g. 2024-W10
+ *   diff <date> <date>        days from the first date to the second
+ *   add <date> <n> <unit>     date n (e.g. +3 or -1) days, weeks, months or
+ *                             years later. Adding months or years keeps the
+ *                             day, or uses the last day of shorter months.
+ *
+ * Dates are written as 2024-03-05. Without dates, every line of stdin holds
+ * the arguments of one query and gets one line of output ("invalid" for
+ * lines that are not), so a script can answer any number of dates with one
+ * process.
+ */
+
+/*  FUNCTION:   parse_date
+ *  Brief:      Parse a date written as 2024-03-05
+ *  Param:
+ *              str: string to parse (the whole string must be the date)
+ *              y, m, d: set to year, month (0=January) and day
+ *
+ *  Return:     Day number, or -1 if str is not a valid date.
+ */
+long parse_date(const char *str, int *y, int *m, int *d){
+    int v[3] = {0, 0, 0}, i = 0, digits = 0;
+    for(const char *p = str; ; p++){
+        if(*p >= '0' && *p <= '9' && digits < 9){
+            v[i] = v[i]*10 + (*p - '0');
+            digits++;
+        } else if(*p == '-' && i < 2 && digits > 0){
+            i++;
+            digits = 0;
+        } else if(*p == '\0' && i == 2 && digits > 0){
+            break;
+        } else {
+            return -1;
+        }
+    }
+    if(v[0] < 1 || v[1] < 1 || v[1] > 12 || v[2] < 1 || v[2] > num_days[is_leap_year(v[0])][v[1]-1]){
+        return -1;
+    }
+    *y = v[0];
+    *m = v[1]-1;
+    *d = v[2];
+    return day_number(*y, *m, *d);
+}
+
+/*  FUNCTION:   iso_week
+ *  Brief:      Calculate the ISO 8601 week of a day
+ *  Param:
+ *              day: day number
+ *              iso_year: set to the year the week belongs to
+ *
+ *  Return:     Week (1-53).
+ */
+int iso_week(long day, int *iso_year){
+    /* The week belongs to the year its Thursday is in (day 0 is a Monday) */
+    long thursday = day - day%7 + 3;
+    int m, d;
+    day_to_date(thursday, iso_year, &m, &d);
+    return (int)((thursday - day_number(*iso_year, 0, 1))/7) + 1;
+}
+
+/*  FUNCTION:   date_query
+ *  Brief:      Answer one date query on a line of its own
+ *  Param:
+ *              fp: stream to print to
+ *              cmd: dow, doy, week, diff or add
+ *              arg: arguments of the query
+ *              num_args: number of arguments
+ *
+ *  Return:     0 if the query was answered, 1 if it was not valid.
+ */
+int date_query(FILE *fp, const char *cmd, char **arg, int num_args){
+    int y, m, d, y2, m2, d2;
+    long day = (num_args > 0) ? parse_date(arg[0], &y, &m, &d) : -1;
+    if(day < 0){
+        return 1;
+    }
+    if(strcmp(cmd, "dow") == 0 && num_args == 1){
+        fprintf(fp, "%s\n", weekday_abbr[day_of_week(day)]);
+    } else if(strcmp(cmd, "doy") == 0 && num_args == 1){
+        fprintf(fp, "%d\n", days_before_month[is_leap_year(y)][m] + d);
+    } else if(strcmp(cmd, "week") == 0 && num_args == 1){
+        int week = iso_week(day, &y2);
+        fprintf(fp, "%04d-W%02d\n", y2, week);
+    } else if(strcmp(cmd, "diff") == 0 && num_args == 2){
+        long day2 = parse_date(arg[1], &y2, &m2, &d2);
+        if(day2 < 0)
+            return 1;
+        fprintf(fp, "%ld\n", day2 - day);
+    } else if(strcmp(cmd, "add") == 0 && num_args == 3){
+        char *end;
+        long n = strtol(arg[1], &end, 10);
+        const char *unit = arg[2];
+        size_t len = strlen(unit);
+        if(*end != '\0' || end == arg[1] || len < 3 || n > 3650000 || n < -3650000)
+            return 1;
+        /* Singular or plural unit */
+        if(unit[len-1] == 's')
+            len--;
+        if(strncmp(unit, "day", len) == 0 && len == 3){
+            day += n;
+        } else if(strncmp(unit, "week", len) == 0 && len == 4){
+            day += n*7;
+        } else if((strncmp(unit, "month", len) == 0 && len == 5) || (strncmp(unit, "year", len) == 0 && len == 4)){
+            long month = (long)y*12 + m + ((len == 5) ? n : n*12);
+            if(month < 12)
+                return 1;
+            y = (int)(month/12);
+            m = (int)(month%12);
+            if(d > num_days[is_leap_year(y)][m])
+                d = num_days[is_leap_year(y)][m];
+            day = day_number(y, m, d);
+        } else {
+            return 1;
+        }
+        if(day < 0)
+            return 1;
+        day_to_date(day, &y, &m, &d);
+        fprintf(fp, "%04d-%02d-%02d\n", y, m+1, d);
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+/*  FUNCTION:   run_query
+ *  Brief:      Run a date query subcommand, on its arguments or on every
+ *              line of stdin
+ *  Param:
+ *              fp: stream to print to
+ *              argc: number of arguments, starting with the subcommand
+ *              argv: arguments
+ *
+ *  Return:     0 on success, 1 if a query given as arguments was not valid.
+ */
+int run_query(FILE *fp, int argc, char **argv){
+    if(argc > 1){
+        if(date_query(fp, argv[0], argv+1, argc-1)){
+            fprintf(stderr, "Invalid %s query\n", argv[0]);
+            return 1;
+        }
+        return 0;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    while(getline(&line, &cap, stdin) > 0){
+        char *arg[4], *save = NULL;
+        int num_args = 0;
+        for(char *tok = strtok_r(line, " \t\r\n", &save); tok && num_args < 4; tok = strtok_r(NULL, " \t\r\n", &save)){
+            arg[num_args++] = tok;
+        }
+        if(num_args > 3 || date_query(fp, argv[0], arg, num_args)){
+            fputs("invalid\n", fp);
+        }
+    }
+    free(line);
+    return 0;
+}
+
+
+/* Epoch conversion
+ *
+ *   epoch [<offset>]
+ *
+ * Reads lines starting with a Unix timestamp (seconds) from stdin and
+ * writes them with the timestamp replaced by its date, time, weekday and
+ * ISO week, e.g. "1709629200 GET /" becomes
+ * "2024-03-05 09:00:00 Tue 2024-W10 GET /". Lines not starting with a
+ * timestamp become "invalid". The offset is a fixed UTC offset such as
+ * +01:00 or -0530, "utc" (the default) or "local" for the local time zone.
+ *
+ * Input is read in large chunks and converted in batches of EPOCH_BATCH
+ * lines: timestamps are parsed, then turned into day numbers and seconds
+ * of the day in one plain loop, and only then formatted. The date, weekday
+ * and week of the last day are kept, since log timestamps mostly share
+ * their day. Local offsets are looked up once per hour and kept in a small
+ * table, so time zone transitions must fall on whole UTC hours.
+ */
+#define EPOCH_BUF (1 << 20)
+#define EPOCH_BATCH 256
+#define EPOCH_DAY0 719162L          /* Day number of 1970-01-01 */
+#define EPOCH_ZONE_CACHE 1024
+
+struct epoch_zone {
+    long hour;                      /* Hours since 1970, LONG_MIN if empty */
+    long offset;                    /* Seconds east of UTC */
+};
+
+/*  FUNCTION:   epoch_offset
+ *  Brief:      Get the local UTC offset of a time, cached per hour
+ */
+long epoch_offset(struct epoch_zone *cache, long t){
+    long hour = (t >= 0) ? t/3600 : -((-t+3599)/3600);
+    struct epoch_zone *z = &cache[(unsigned long)hour % EPOCH_ZONE_CACHE];
+    if(z->hour != hour){
+        time_t tt = (time_t)t;
+        struct tm tm;
+        z->hour = hour;
+        z->offset = (localtime_r(&tt, &tm)) ? tm.tm_gmtoff : 0;
+    }
+    return z->offset;
+}
+
+/*  FUNCTION:   parse_utc_offset
+ *  Brief:      Parse a UTC offset such as +01:00, -0530 or +2
+ *  Return:     1 if str was a valid offset, 0 if it was not.
+ */
+int parse_utc_offset(const char *str, long *offset){
+    const char *p = str+1;
+    int h = 0, m = 0, digits = 0;
+    if(str[0] != '+' && str[0] != '-'){
+        return 0;
+    }
+    /* One or two hour digits, then optionally minutes after a ':' or right after two hour digits */
+    for(; digits < 2 && isdigit((unsigned char)*p); digits++)
+        h = h*10 + (*p++ - '0');
+    if(digits == 0){
+        return 0;
+    }
+    if(*p == ':' || (digits == 2 && *p != '\0')){
+        p += (*p == ':');
+        if(!isdigit((unsigned char)p[0]) || !isdigit((unsigned char)p[1])){
+            return 0;
+        }
+        m = (p[0]-'0')*10 + (p[1]-'0');
+        p += 2;
+    }
+    if(*p != '\0' || h > 14 || m > 59){
+        return 0;
+    }
+    *offset = (h*3600L + m*60L)*((str[0] == '-') ? -1 : 1);
+    return 1;
+}
+
+/*  FUNCTION:   epoch_batch
+ *  Brief:      Convert and print a batch of lines
+ *  Param:
+ *              fp: stream to print to
+ *              line: start of each line
+ *              end: end of each line (at its newline)
+ *              count: number of lines
+ *              offset: fixed UTC offset in seconds
+ *              cache: local offsets, NULL to use the fixed offset
+ *              last_day: day of the kept fields, -1 before the first
+ *              fields: kept "YYYY-MM-DD" date, weekday and week of last_day
+ */
+void epoch_batch(FILE *fp, char **line, char **end, int count, long offset, struct epoch_zone *cache, long *last_day, char *fields){
+    long t[EPOCH_BATCH], day[EPOCH_BATCH], sec[EPOCH_BATCH];
+    char *rest[EPOCH_BATCH];
+    int valid[EPOCH_BATCH];
+
+    for(int i = 0; i < count; i++){
+        char *p = line[i];
+        int neg = (*p == '-');
+        long v = 0;
+        p += neg;
+        valid[i] = (*p >= '0' && *p <= '9');
+        while(*p >= '0' && *p <= '9' && v < 1000000000000L){
+            v = v*10 + (*p++ - '0');
+        }
+        valid[i] = valid[i] && (p == end[i] || *p == ' ' || *p == '\t' || *p == ',' || *p == '\r');
+        t[i] = (neg) ? -v : v;
+        rest[i] = p;
+    }
+    if(cache){
+        for(int i = 0; i < count; i++)
+            t[i] += epoch_offset(cache, t[i]);
+    } else {
+        for(int i = 0; i < count; i++)
+            t[i] += offset;
+    }
+    /* Floored division, so times before 1970 fall on the right day */
+    for(int i = 0; i < count; i++){
+        long q = t[i]/86400 - (t[i]%86400 < 0);
+        day[i] = q + EPOCH_DAY0;
+        sec[i] = t[i] - q*86400;
+    }
+
+    for(int i = 0; i < count; i++){
+        char out[40];
+        if(!valid[i] || day[i] < 0 || day[i] >= 3652059){
+            fputs("invalid\n", fp);
+            continue;
+        }
+        if(day[i] != *last_day){
+            int y, m, d, iso_year, week = iso_week(day[i], &iso_year);
+            day_to_date(day[i], &y, &m, &d);
+            ics_put_pair(fields, y/100);
+            ics_put_pair(fields+2, y%100);
+            fields[4] = '-';
+            ics_put_pair(fields+5, m+1);
+            fields[7] = '-';
+            ics_put_pair(fields+8, d);
+            /* fields+10 holds " hh:mm:ss " of each line */
+            memcpy(fields+20, weekday_abbr[day_of_week(day[i])], 3);
+            fields[23] = ' ';
+            ics_put_pair(fields+24, iso_year/100);
+            ics_put_pair(fields+26, iso_year%100);
+            fields[28] = '-';
+            fields[29] = 'W';
+            ics_put_pair(fields+30, week);
+            *last_day = day[i];
+        }
+        memcpy(out, fields, 32);
+        out[10] = ' ';
+        ics_put_pair(out+11, (int)(sec[i]/3600));
+        out[13] = ':';
+        ics_put_pair(out+14, (int)(sec[i]/60%60));
+        out[16] = ':';
+        ics_put_pair(out+17, (int)(sec[i]%60));
+        out[19] = ' ';
+        fwrite(out, 1, 32, fp);
+        fwrite(rest[i], 1, end[i] - rest[i], fp);
+        fputc('\n', fp);
+    }
+}
+
+/*  FUNCTION:   run_epoch
+ *  Brief:      Convert the timestamps of stdin
+ *  Param:
+ *              fp: stream to print to
+ *              argc: number of arguments, starting with "epoch"
+ *              argv: arguments
+ *
+ *  Return:     0 on success, 1 if the offset was not valid.
+ */
+int run_epoch(FILE *fp, int argc, char **argv){
+    long offset = 0, last_day = -1;
+    struct epoch_zone *cache = NULL;
+    char fields[40];
+    if(argc > 1 && strcmp(argv[1], "local") == 0){
+        cache = malloc(EPOCH_ZONE_CACHE*sizeof(*cache));
+        for(int i = 0; i < EPOCH_ZONE_CACHE; i++)
+            cache[i].hour = LONG_MIN;
+        tzset();
+    } else if(argc > 1 && strcmp(argv[1], "utc") != 0 && !parse_utc_offset(argv[1], &offset)){
+        fprintf(stderr, "Invalid UTC offset %s\n", argv[1]);
+        return 1;
+    }
+
+    char *buf = malloc(EPOCH_BUF);
+    size_t have = 0;
+    int eof = 0;
+    while(!eof){
+        size_t n = fread(buf + have, 1, EPOCH_BUF - have, stdin);
+        char *line[EPOCH_BATCH], *end[EPOCH_BATCH];
+        int count = 0;
+        char *p = buf, *stop;
+        have += n;
+        eof = (n == 0);
+        /* Whole lines only, unless at the end or a line fills the buffer */
+        stop = memrchr(buf, '\n', have);
+        if(!stop && (eof || have == EPOCH_BUF))
+            stop = buf + have;
+        while(stop && p < stop){
+            char *nl = memchr(p, '\n', stop - p);
+            line[count] = p;
+            end[count] = (nl) ? nl : stop;
+            if(end[count] > p && end[count][-1] == '\r')
+                end[count]--;
+            p = ((nl) ? nl : stop) + 1;
+            if(++count == EPOCH_BATCH){
+                epoch_batch(fp, line, end, count, offset, cache, &last_day, fields);
+                count = 0;
+            }
+        }
+        epoch_batch(fp, line, end, count, offset, cache, &last_day, fields);
+        if(stop){
+            size_t used = (p < buf + have) ? (size_t)(p - buf) : have;
+            memmove(buf, buf + used, have - used);
+            have -= used;
+        }
+    }
+    free(buf);
+    free(cache);
+    return 0;
+}
+
+
+/* Log annotation
+ *
+ *   annotate <file> [weekday | week | fiscal <periods> <end>]
+ *
+ * Prefixes every line of a file with the weekday ("Tue"), ISO week
+ * ("2024-W10", the default) or fiscal period ("FY2024-P03", see --fiscal)
+ * of the time it starts with: a date (2024-03-05, optionally followed by
+ * a time) or Unix timestamp in seconds (UTC). Timestamps need at least
+ * ANNOTATE_MIN_DIGITS digits (1973-03-03 onwards), so times of day ("10:15")
+ * or status codes ("404") are not taken for 1970. Lines without a date or
+ * timestamp get "-".
+ *
+ * The file is mapped into memory and cut into chunks of about
+ * ANNOTATE_CHUNK bytes at line ends. Worker threads, one per CPU, annotate
+ * chunks into an ordered ring of buffers, which the main thread writes out
+ * in file order (the same ring as -c uses for years). Every
+ * worker keeps the tag of the last day it saw, since neighbouring lines of
+ * a log mostly share their day.
+ */
+#define ANNOTATE_CHUNK (1 << 20)
+#define ANNOTATE_MIN_DIGITS 9
+
+enum annotate_tag {TAG_WEEKDAY, TAG_WEEK, TAG_FISCAL};
+const int annotate_tag_len[3] = {3, 8, 10};
+
+struct annotate_slot {
+    char *buf;
+    size_t len;
+};
+
+struct annotate_ring {
+    struct ordered_ring order;
+    struct annotate_slot slot[RING_SLOTS];
+    const char *data;
+    const size_t *chunk_start;      /* num_chunks+1 offsets into data */
+    enum annotate_tag tag;
+};
+
+/*  FUNCTION:   line_day
+ *  Brief:      Find the day a log line starts with
+ *  Param:
+ *              p: start of the line
+ *              end: end of the line
+ *
+ *  Return:     Day number, -1 if the line does not start with a date or timestamp.
+ */
+long line_day(const char *p, const char *end){
+    long v = 0;
+    const char *q = p;
+    while(q < end && *q >= '0' && *q <= '9' && q - p < 12){
+        v = v*10 + (*q++ - '0');
+    }
+    /* A date (q - p == 4 means p[0..3] are digits) */
+    if(q - p == 4 && end - p >= 10 && p[4] == '-' && p[7] == '-'){
+        if(!isdigit((unsigned char)p[5]) || !isdigit((unsigned char)p[6]) || !isdigit((unsigned char)p[8]) || !isdigit((unsigned char)p[9]))
+            return -1;
+        int y = (int)v, m = (p[5]-'0')*10 + (p[6]-'0'), d = (p[8]-'0')*10 + (p[9]-'0');
+        if(y < 1 || m < 1 || m > 12 || d < 1 || d > num_days[is_leap_year(y)][m-1])
+            return -1;
+        return day_number(y, m-1, d);
+    }
+    /* A Unix timestamp */
+    if(q - p >= ANNOTATE_MIN_DIGITS && (q == end || *q < '0' || *q > '9')){
+        return EPOCH_DAY0 + v/86400;
+    }
+    return -1;
+}
+
+/*  FUNCTION:   annotate_tag
+ *  Brief:      Write the tag of a day
+ *  Param:
+ *              buf: set to the tag (annotate_tag_len[tag] characters)
+ *              day: day number
+ *              tag: kind of tag
+ */
+void annotate_tag(char *buf, long day, enum annotate_tag tag){
+    if(tag == TAG_WEEKDAY){
+        memcpy(buf, weekday_abbr[day_of_week(day)], 3);
+    } else if(tag == TAG_WEEK){
+        int year, week = iso_week(day, &year);
+        ics_put_pair(buf, (year/100)%100);
+        ics_put_pair(buf+2, year%100);
+        buf[4] = '-';
+        buf[5] = 'W';
+        ics_put_pair(buf+6, week);
+    } else {
+        struct fiscal_year fy;
+        int p = 0;
+        fiscal_year_of(day, &fy);
+        while(p < 11 && day >= fy.period[p+1])
+            p++;
+        buf[0] = 'F';
+        buf[1] = 'Y';
+        ics_put_pair(buf+2, (fy.year/100)%100);
+        ics_put_pair(buf+4, fy.year%100);
+        buf[6] = '-';
+        buf[7] = 'P';
+        ics_put_pair(buf+8, p+1);
+    }
+}
+
+/*  FUNCTION:   annotate_worker
+ *  Brief:      Worker thread. Claims chunks from the ring in order and
+ *              annotates the chunk's lines into its slot.
+ *  Param:
+ *              arg: struct annotate_ring shared with the writer
+ */
+void *annotate_worker(void *arg){
+    struct annotate_ring *ring = arg;
+    int tag_len = annotate_tag_len[ring->tag];
+    long last_day = -1;
+    char tag[16];
+    long chunk;
+    int failed;
+    while((chunk = ring_claim(&ring->order, &failed)) >= 0){
+        struct annotate_slot *slot = &ring->slot[chunk%RING_SLOTS];
+        const char *p = ring->data + ring->chunk_start[chunk];
+        const char *stop = ring->data + ring->chunk_start[chunk+1];
+        /* Every line grows by its tag and a space (and maybe a newline) */
+        size_t cap = (stop - p) + (size_t)(tag_len+2)*ANNOTATE_CHUNK/8 + 64, len = 0;
+        char *buf = (failed) ? NULL : malloc(cap);
+        if(!buf){
+            p = stop;
+        }
+        while(p < stop){
+            const char *nl = memchr(p, '\n', stop - p);
+            const char *end = (nl) ? nl : stop;
+            long day = line_day(p, end);
+            if(len + (end - p) + tag_len + 2 > cap){
+                cap = (cap + (end - p) + tag_len + 2)*2;
+                char *grown = realloc(buf, cap);
+                if(!grown){
+                    free(buf);
+                    buf = NULL;
+                    break;
+                }
+                buf = grown;
+            }
+            if(day < 0){
+                buf[len] = '-';
+                memset(buf + len+1, ' ', tag_len-1);
+            } else {
+                if(day != last_day){
+                    annotate_tag(tag, day, ring->tag);
+                    last_day = day;
+                }
+                memcpy(buf + len, tag, tag_len);
+            }
+            len += tag_len;
+            buf[len++] = ' ';
+            memcpy(buf + len, p, end - p);
+            len += end - p;
+            buf[len++] = '\n';
+            p = end + 1;
+        }
+        slot->buf = buf;
+        slot->len = (buf) ? len : 0;
+        ring_done(&ring->order, chunk, !buf);
+    }
+    return NULL;
+}
+
+/*  FUNCTION:   run_annotate
+ *  Brief:      Annotate the lines of a file, in parallel, and print them in order
+ *  Param:
+ *              fp: stream to print to
+ *              argc: number of arguments, starting with "annotate"
+ *              argv: arguments
+ *
+ *  Return:     0 on success, 1 on errors.
+ */
+int run_annotate(FILE *fp, int argc, char **argv){
+    static struct annotate_ring ring;
+    enum annotate_tag tag = TAG_WEEK;
+    struct stat st;
+    int fd;
+
+    if(argc < 2){
+        print_help();
+        return 1;
+    }
+    if(argc > 2 && strcmp(argv[2], "weekday") == 0){
+        tag = TAG_WEEKDAY;
+    } else if(argc > 4 && strcmp(argv[2], "fiscal") == 0 && (fiscal = parse_fiscal(argv[3], argv[4]))){
+        tag = TAG_FISCAL;
+    } else if(argc > 2 && strcmp(argv[2], "week") != 0){
+        print_help();
+        return 1;
+    }
+    fd = open(argv[1], O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0){
+        fprintf(stderr, "Could not open %s for reading\n", argv[1]);
+        return 1;
+    }
+    if(st.st_size == 0){
+        close(fd);
+        return 0;
+    }
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        fprintf(stderr, "Could not open %s for reading\n", argv[1]);
+        return 1;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    /* Cut into chunks after the first newline past every ANNOTATE_CHUNK bytes */
+    long max_chunks = st.st_size/ANNOTATE_CHUNK + 2, num_chunks = 0;
+    size_t *chunk_start = malloc(max_chunks*sizeof(size_t));
+    if(!chunk_start){
+        fprintf(stderr, "Out of memory\n");
+        munmap((void *)data, st.st_size);
+        return 1;
+    }
+    size_t pos = 0;
+    while(pos < (size_t)st.st_size){
+        chunk_start[num_chunks++] = pos;
+        if(st.st_size - pos <= ANNOTATE_CHUNK){
+            pos = st.st_size;
+        } else {
+            const char *nl = memchr(data + pos + ANNOTATE_CHUNK, '\n', st.st_size - pos - ANNOTATE_CHUNK);
+            pos = (nl) ? (size_t)(nl - data) + 1 : (size_t)st.st_size;
+        }
+    }
+    chunk_start[num_chunks] = st.st_size;
+
+    long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_workers < 1){
+        num_workers = 1;
+    }
+    pthread_t workers[num_workers];
+    ring_init(&ring.order, num_chunks);
+    ring.data = data;
+    ring.chunk_start = chunk_start;
+    ring.tag = tag;
+    long started = ring_start(workers, num_workers, annotate_worker, &ring);
+    if(started == 0){
+        fprintf(stderr, "Could not start annotation threads\n");
+        munmap((void *)data, st.st_size);
+        free(chunk_start);
+        return 1;
+    }
+
+    /* Writer: drain chunks in order, after a failure without writing them */
+    for(long chunk = 0; chunk < num_chunks; chunk++){
+        struct annotate_slot *slot = &ring.slot[chunk%RING_SLOTS];
+        int failed = ring_wait(&ring.order, chunk);
+        if(!failed && fwrite(slot->buf, 1, slot->len, fp) != slot->len){
+            failed = 1;
+        }
+        free(slot->buf);
+        ring_drained(&ring.order, chunk, failed);
+    }
+    for(long i = 0; i < started; i++){
+        pthread_join(workers[i], NULL);
+    }
+    munmap((void *)data, st.st_size);
+    free(chunk_start);
+    if(ring.order.failed){
+        fprintf(stderr, "Could not annotate %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Range statistics
+ *
+ *   stats <date> <date>
+ *
+ * Counts, for the days from the first date to the second (both included),
+ * the days of each weekday, the months starting in the range by the weekday
+ * they start on, the leap days, and the months starting in the range that
+ * have five full weekends (31 days starting on a Friday).
+ *
+ * Every count is a difference of counts before a day, which take constant
+ * time: weekdays repeat every 7 days, and months and leap years repeat
+ * every 400 years (146097 days, a whole number of weeks), so months are
+ * counted as whole cycles plus a prefix table over the 4800 months of one.
+ */
+#define CYCLE_MONTHS 4800
+
+struct month_cycle {
+    int start[CYCLE_MONTHS+1][7];   /* Months before month k of a cycle starting on each weekday */
+    int five[CYCLE_MONTHS+1];       /* Months before month k with five weekends */
+};
+
+/*  FUNCTION:   month_cycle
+ *  Brief:      Get the prefix tables of a 400 year cycle, built on the first use
+ */
+const struct month_cycle *month_cycle(){
+    static struct month_cycle *cycle = NULL;
+    if(!cycle){
+        cycle = calloc(1, sizeof(*cycle));
+        for(int k = 0; k < CYCLE_MONTHS; k++){
+            int y = k/12 + 1, m = k%12;
+            int dow = month_start_day(y, m);
+            memcpy(cycle->start[k+1], cycle->start[k], sizeof(cycle->start[k]));
+            cycle->start[k+1][dow]++;
+            cycle->five[k+1] = cycle->five[k] + (dow == 5 && num_days[is_leap_year(y)][m] == 31);
+        }
+    }
+    return cycle;
+}
+
+/*  FUNCTION:   count_before
+ *  Brief:      Count weekdays, month starts, leap days and five weekend
+ *              months before a day
+ *  Param:
+ *              day: day number
+ *              weekdays: set to the days of each weekday (0=Sunday)
+ *              starts: set to the months starting on each weekday
+ *              leap_days: set to the leap days
+ *              five: set to the months with five weekends
+ */
+void count_before(long day, long *weekdays, long *starts, long *leap_days, long *five){
+    const struct month_cycle *cycle = month_cycle();
+    int y, m, d;
+    day_to_date(day, &y, &m, &d);
+    long months = (long)(y-1)*12 + m + (d > 1);
+    long cycles = months/CYCLE_MONTHS, rest = months%CYCLE_MONTHS;
+    for(int k = 0; k < 7; k++){
+        /* Day numbers x < day with (x+1)%7 == k */
+        long r = (k+6)%7;
+        weekdays[k] = (day > r) ? (day-1-r)/7 + 1 : 0;
+        starts[k] = cycles*cycle->start[CYCLE_MONTHS][k] + cycle->start[rest][k];
+    }
+    *five = cycles*cycle->five[CYCLE_MONTHS] + cycle->five[rest];
+    *leap_days = (long)(y-1)/4 - (y-1)/100 + (y-1)/400 + (is_leap_year(y) && m > 1);
+}
+
+/*  FUNCTION:   run_stats
+ *  Brief:      Print the statistics of a range of days
+ *  Param:
+ *              fp: stream to print to
+ *              argc: number of arguments, starting with "stats"
+ *              argv: arguments
+ *
+ *  Return:     0 on success, 1 if the dates were not valid.
+ */
+int run_stats(FILE *fp, int argc, char **argv){
+    int y, m, d;
+    long first = (argc == 3) ? parse_date(argv[1], &y, &m, &d) : -1;
+    long last = (argc == 3) ? parse_date(argv[2], &y, &m, &d) : -1;
+    long w0[7], w1[7], s0[7], s1[7], l0, l1, f0, f1;
+    if(first < 0 || last < first){
+        fprintf(stderr, "Invalid stats query\n");
+        return 1;
+    }
+    count_before(first, w0, s0, &l0, &f0);
+    count_before(last+1, w1, s1, &l1, &f1);
+
+    fprintf(fp, "%s - %s: %ld days\n\n", argv[1], argv[2], last - first + 1);
+    fprintf(fp, "%-15s", "");
+    for(int k = 0; k < 7; k++)
+        fprintf(fp, " %10s", weekday_abbr[k]);
+    fprintf(fp, "\n%-15s", "Days");
+    for(int k = 0; k < 7; k++)
+        fprintf(fp, " %10ld", w1[k] - w0[k]);
+    fprintf(fp, "\n%-15s", "Month starts");
+    for(int k = 0; k < 7; k++)
+        fprintf(fp, " %10ld", s1[k] - s0[k]);
+    fprintf(fp, "\n\nLeap days: %ld\n", l1 - l0);
+    fprintf(fp, "Months with five weekends: %ld\n", f1 - f0);
+    return 0;
+}
+
+
+/*  FUNCTION:   run
+ *  Brief:      Handle input arguments and run program accordingly
+ *  Param:      
+ *              fp: stream to print to
+ *              y: year
+ *              m: month (to start print from)
+ *              n: How many month (forward) to print. Continues into following years.
+ *                 Ex. -m 10 -n 4 prints November 2022 to February 2023.
+ *              w: If set (to 1) include week numbers
+ */
+int run(FILE *fp, int y, int m, int n, int w){
+    int *date = get_current_date();
+    if(y > 0 && m < 0){
+        print_year(fp, y, w);
+        return 0;
+    }
+    if(y < 1){
+        y = date[2];
+    }
+    if(m < 0){
+        m = date[1];
+    }
+    if(n == 12){
+        print_year(fp, y, w);
+        return 0;
+    } else if(n < 1){
+        n = 1;
+    }
+    print_months(fp, y, m, n, w);
+    return 0;
+}
+
+
+int main(int argc, char *argv[]){
+    int y = 0, m = -1, n = 0, w = 0, years = 0, dedup = 0, compress = 0;
+    FILE *fp = stdout;
+    FILE *archive = NULL;
+    char *busy_paths[argc];
+    int num_busy_paths = 0;
+    long slot_duration = 0, work_start = 9*60, work_end = 17*60;
+    int max_slots = 0, num_slots = 0;
+    long *slot = NULL;
+    char *event_paths[argc];
+    int is_store[argc];
+    int num_event_paths = 0, conflicts = 0;
+    struct event_list events = {NULL, 0, 0};
+    long file_start[argc+1];
+    struct rule_list rules = {NULL, 0};
+    long agenda = 0;
+    long week = -1;
+    struct cron *cron = NULL;
+    int num_cron = 0, fires = 5;
+    int hours_set = 0, watch = 0, ics = 0;
+    char *grep = NULL;
+    struct conflict *conflict = NULL;
+    long num_conflicts = 0;
+
+    /* Fully buffer output so a whole render goes out in a few writes */
+    static char out_buf[1 << 16];
+    setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+    /* Date queries are subcommands, so they come before the options */
+    if(argc > 1 && strcmp(argv[1], "stats") == 0){
+        int ret = run_stats(stdout, argc-1, argv+1);
+        fclose(stdout);
+        return ret;
+    }
+    if(argc > 1 && strcmp(argv[1], "annotate") == 0){
+        int ret = run_annotate(stdout, argc-1, argv+1);
+        fclose(stdout);
+        return ret;
+    }
+    if(argc > 1 && strcmp(argv[1], "epoch") == 0){
+        int ret = run_epoch(stdout, argc-1, argv+1);
+        fclose(stdout);
+        return ret;
+    }
+    if(argc > 1 && (strcmp(argv[1], "dow") == 0 || strcmp(argv[1], "doy") == 0 || strcmp(argv[1], "week") == 0 || strcmp(argv[1], "diff") == 0 || strcmp(argv[1], "add") == 0)){
+        int ret = run_query(stdout, argc-1, argv+1);
+        fclose(stdout);
+        return ret;
+    }
+
+    int from_y = 0, from_m = -1, to_y = 0, to_m = -1;
+
+    for(int i = 1; i < argc; i++){
+        char c = argv[i][1];
+        switch(c){
+            case '-':
+                if(strcmp(argv[i], "--from") == 0 && argv[i+1] && parse_year_month(argv[i+1], &from_y, &from_m)){
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--to") == 0 && argv[i+1] && parse_year_month(argv[i+1], &to_y, &to_m)){
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--busy") == 0 && argv[i+1]){
+                    busy_paths[num_busy_paths++] = argv[i+1];
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--slots") == 0 && argv[i+1] && argv[i+2]){
+                    slot_duration = atol(argv[i+1]);
+                    max_slots = atoi(argv[i+2]);
+                    i += 2;
+                    break;
+                } else if(strcmp(argv[i], "--events") == 0 && argv[i+1]){
+                    is_store[num_event_paths] = 0;
+                    event_paths[num_event_paths++] = argv[i+1];
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--store") == 0 && argv[i+1]){
+                    is_store[num_event_paths] = 1;
+                    event_paths[num_event_paths++] = argv[i+1];
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--store-add") == 0 && argv[i+1]){
+                    return append_store(argv[i+1]);
+                } else if(strcmp(argv[i], "--grep") == 0 && argv[i+1]){
+                    grep = argv[i+1];
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--fiscal") == 0 && argv[i+1] && argv[i+2]){
+                    fiscal = parse_fiscal(argv[i+1], argv[i+2]);
+                    if(!fiscal){
+                        print_help();
+                        return 0;
+                    }
+                    i += 2;
+                    break;
+                } else if(strcmp(argv[i], "--theme") == 0 && argv[i+1]){
+                    int t = 0;
+                    while(themes[t].name && strcmp(themes[t].name, argv[i+1]) != 0)
+                        t++;
+                    if(!themes[t].name){
+                        print_help();
+                        return 0;
+                    }
+                    theme = &themes[t];
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--select") == 0 && argv[i+1] && strstr(argv[i+1], "..")){
+                    char first[32];
+                    int sy, sm, sd;
+                    snprintf(first, sizeof(first), "%.*s", (int)(strstr(argv[i+1], "..") - argv[i+1]), argv[i+1]);
+                    select_first = parse_date(first, &sy, &sm, &sd);
+                    select_last = parse_date(strstr(argv[i+1], "..") + 2, &sy, &sm, &sd);
+                    if(select_first < 0 || select_last < select_first){
+                        print_help();
+                        return 0;
+                    }
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--ics") == 0){
+                    ics = 1;
+                    break;
+                } else if(strcmp(argv[i], "--watch") == 0){
+                    watch = 1;
+                    break;
+                } else if(strcmp(argv[i], "--holidays") == 0 && argv[i+1]){
+                    holidays = load_holidays(argv[i+1]);
+                    if(!holidays){
+                        return 1;
+                    }
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--compile-days") == 0 && argv[i+1] && argv[i+2]){
+                    return compile_days(argv[i+1], argv[i+2]);
+                } else if(strcmp(argv[i], "--compact") == 0 && argv[i+1]){
+                    return compact_store(argv[i+1]);
+                } else if(strcmp(argv[i], "--conflicts") == 0){
+                    conflicts = 1;
+                    break;
+                } else if(strcmp(argv[i], "--rules") == 0 && argv[i+1]){
+                    if(load_rules(argv[i+1], &rules)){
+                        return 1;
+                    }
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--agenda") == 0 && argv[i+1]){
+                    agenda = atol(argv[i+1]);
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--hours") == 0 && argv[i+1] && parse_hours(argv[i+1], &work_start, &work_end)){
+                    hours_set = 1;
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--cron") == 0 && argv[i+1]){
+                    cron = realloc(cron, (num_cron+1)*sizeof(*cron));
+                    if(!parse_cron(argv[i+1], &cron[num_cron])){
+                        fprintf(stderr, "Malformed cron expression: %s\n", argv[i+1]);
+                        return 1;
+                    }
+                    num_cron++;
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--crontab") == 0 && argv[i+1]){
+                    if(load_crontab(argv[i+1], &cron, &num_cron)){
+                        return 1;
+                    }
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--fires") == 0 && argv[i+1]){
+                    fires = atoi(argv[i+1]);
+                    i += 1;
+                    break;
+                } else if(strcmp(argv[i], "--week") == 0 && argv[i+1]){
+                    if(strcmp(argv[i+1], "now") == 0){
+                        week = current_time()/MINUTES_PER_DAY;
+                    } else if(parse_time(argv[i+1], 0, &week)){
+                        week /= MINUTES_PER_DAY;
+                    } else {
+                        print_help();
+                        return 0;
+                    }
+                    i += 1;
+                    break;
+                } else {
+                    print_help();
+                    return 0;
+                }
+            case 'w':
+                w = 1;
+                break;
+            case 'j':
+                julian = 1;
+                break;
+            case 'n':
+                if(argv[i+1]){
+                    n = atoi(argv[i+1]);
+                    i += 1;
+                    break;
+                } else {
+                    print_help();
+                    return 0;
+                }
+            case 'm':
+                if(argv[i+1]){
+                    m = atoi(argv[i+1]);
+                    i += 1;
+                    break;
+                } else {
+                    print_help();
+                    return 0;
+                }
+            case 'y':
+                if(argv[i+1]){
+                    y = atoi(argv[i+1]);
+                    i += 1;
+                    break;
+                } else {
+                    print_help();
+                    return 0;
+                }
+            case 'c':
+                if(argv[i+1]){
+                    years = atoi(argv[i+1]);
+                    i += 1;
+                    break;
+                } else {
+                    print_help();
+                    return 0;
+                }
+            case 'd':
+                dedup = 1;
+                break;
+            case 'z':
+                compress = 1;
+                break;
+            case 'r':
+                if(argv[i+1]){
+                    archive = fopen(argv[i+1], "r");
+                    if(!archive){
+                        fprintf(stderr, "Could not open %s for reading\n", argv[i+1]);
+                        return 1;
+                    }
+                    i += 1;
+                    break;
+                } else {
+                    print_help();
+                    return 0;
+                }
+            case 'o':
+                if(argv[i+1]){
+                    fp = fopen(argv[i+1], "w");
+                    if(!fp){
+                        fprintf(stderr, "Could not open %s for writing\n", argv[i+1]);
+                        return 1;
+                    }
+                    i += 1;
+                    break;
+                } else {
+                    print_help();
+                    return 0;
+                }
+            default:
+                print_help();
+                return 0;
+        }
+    }
+
+    if(archive){
+        int ret = read_export(fp, archive);
+        fclose(fp);
+        if(ret){
+            fprintf(stderr, "Malformed export\n");
+        }
+        return ret;
+    }
+
+    /* Show busy people per day instead of day numbers */
+    if(num_busy_paths > 0){
+        struct person *person = load_persons(busy_paths, num_busy_paths);
+        if(!person){
+            return 1;
+        }
+        day_counts = count_busy(person, num_busy_paths);
+
+        /* Search slots from the first printed month, or from now */
+        if(max_slots > 0){
+            long from = start_time(y, m, from_y, from_m);
+            slot = malloc(max_slots*sizeof(long));
+            num_slots = find_slots(person, num_busy_paths, from, slot_duration, work_start, work_end, slot, max_slots);
+            day_marks = merge_marks(day_marks, mark_slots(slot, num_slots));
+        }
+    }
+
+    /* Stores only load the events of the time that is printed */
+    long range_from, range_to;
+    if(week >= 0){
+        range_from = (week - day_of_week(week))*MINUTES_PER_DAY;
+        range_to = range_from + ((n > 0) ? n : 1)*7L*MINUTES_PER_DAY;
+    } else if(agenda > 0){
+        range_from = start_time(y, m, from_y, from_m);
+        range_to = LONG_MAX;
+    } else {
+        long first, last;
+        printed_days(y, m, n, from_y, from_m, to_y, to_m, years, &first, &last);
+        range_from = first*MINUTES_PER_DAY;
+        range_to = (last+1)*MINUTES_PER_DAY;
+    }
+    for(int i = 0; i < num_event_paths; i++){
+        file_start[i] = events.count;
+        if(is_store[i]){
+            if(load_store(event_paths[i], i, range_from, range_to, &events)){
+                return 1;
+            }
+        } else if(load_events(event_paths[i], i, &events)){
+            return 1;
+        }
+    }
+    file_start[num_event_paths] = events.count;
+
+    /* Print n weeks with hour rows instead of months */
+    if(week >= 0){
+        int first_hour = (hours_set) ? (int)(work_start/60) : 0;
+        int last_hour = (hours_set) ? (int)((work_end+59)/60) : 24;
+        for(int i = 0; i < ((n > 0) ? n : 1); i++){
+            if(i > 0){
+                fprintf(fp, "\n");
+            }
+            print_week(fp, week + i*7, first_hour, last_hour, &events, &rules);
+        }
+        fclose(fp);
+        return 0;
+    }
+
+    /* Write the printed months as iCalendar instead */
+    if(ics){
+        export_ics(fp, range_from/MINUTES_PER_DAY, (range_to-1)/MINUTES_PER_DAY, &events, &rules, cron, num_cron);
+        fclose(fp);
+        return 0;
+    }
+
+    /* List upcoming events from the first printed month, or from now */
+    if(agenda > 0){
+        long from = start_time(y, m, from_y, from_m);
+        print_agenda(fp, &events, file_start, num_event_paths, &rules, from, agenda);
+        fclose(fp);
+        return 0;
+    }
+
+    /* Highlight days with overlapping events, days with events matching
+       --grep, or else days with events. Watch mode does this itself every
+       time the files change. */
+    if(conflicts && !watch){
+        conflict = find_conflicts(&events, &num_conflicts);
+        day_marks = merge_marks(day_marks, mark_conflicts(conflict, num_conflicts));
+    } else if(grep && !watch){
+        struct day_marks *found = calloc(1, sizeof(*found));
+        found->first_day = range_from/MINUTES_PER_DAY;
+        found->num_days = (range_to-1)/MINUTES_PER_DAY - found->first_day + 1;
+        found->mark = calloc(found->num_days, 1);
+        for(int i = 0; i < num_event_paths; i++){
+            grep_events(grep, event_paths[i], is_store[i], events.ev + file_start[i], file_start[i+1] - file_start[i], found);
+        }
+        day_marks = merge_marks(day_marks, found);
+    } else if(events.count > 0 && !watch){
+        day_marks = merge_marks(day_marks, mark_events(&events, range_from/MINUTES_PER_DAY, (range_to-1)/MINUTES_PER_DAY));
+    }
+
+    /* Highlight the first day of every fiscal period */
+    if(fiscal){
+        long first, last;
+        printed_days(y, m, n, from_y, from_m, to_y, to_m, years, &first, &last);
+        day_marks = merge_marks(day_marks, mark_fiscal(first, last));
+    }
+
+    /* Highlight the days cron jobs fire on */
+    if(num_cron > 0){
+        long first, last;
+        printed_days(y, m, n, from_y, from_m, to_y, to_m, years, &first, &last);
+        for(int i = 0; i < num_cron; i++){
+            day_marks = merge_marks(day_marks, mark_cron(&cron[i], first, last));
+        }
+    }
+
+    /* Keep printing the months as the event files change */
+    if(watch){
+        struct grid_view view;
+        if(years > 0 || num_event_paths == 0 || grid_view_init(&view, y, m, n, w, from_y, from_m, to_y, to_m)){
+            print_help();
+            return 0;
+        }
+        return watch_events(fp, &view, event_paths, is_store, num_event_paths, conflicts, grep);
+    }
+
+    /* A --from/--to range is printed as one continuous stream of months */
+    if(from_m >= 0 || to_m >= 0){
+        int *date = get_current_date();
+        if(from_m < 0){
+            from_y = date[2];
+            from_m = date[1];
+        }
+        long span = month_span(from_y, from_m, to_y, to_m, n);
+        if(span < 1){
+            print_help();
+            return 0;
+        }
+        print_months(fp, from_y, from_m, (int)span, w);
+    } else if(years > 0){
+        if(y < 1){
+            y = get_current_date()[2];
+        }
+        if(export_years(fp, y, years, w, dedup, compress)){
+            return 1;
+        }
+    } else {
+        run(fp, y, m, n, w);
+    }
+
+    if(slot){
+        print_slots(fp, slot, num_slots, slot_duration);
+    }
+    if(conflicts){
+        print_conflicts(fp, conflict, num_conflicts, event_paths);
+    }
+    if(num_cron > 0){
+        print_cron(fp, cron, num_cron, start_time(y, m, from_y, from_m), fires);
+    }
+    if(fiscal && years == 0){
+        long first, last;
+        printed_days(y, m, n, from_y, from_m, to_y, to_m, years, &first, &last);
+        print_fiscal(fp, first, last);
     }
+    fclose(fp);
 
-    run(y, m, n, w);
-    
     return 0;
 }
\ No newline at end of file